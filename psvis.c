@@ -4,8 +4,18 @@
 #include <linux/kernel.h>
 #include <linux/list.h>
 #include <linux/pid.h>
+#include <linux/rcupdate.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
+#include <linux/sched/task.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/fdtable.h>
+#include <linux/bitmap.h>
+#include <linux/proc_fs.h>
+#include <linux/ptrace.h>
+#include <linux/seq_file.h>
+#include <linux/uaccess.h>
 
 
 // Meta Information
@@ -15,45 +25,357 @@ MODULE_DESCRIPTION("Welcome to psvis module for comp304 project 1");
 
 int pid;
 module_param(pid, int, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-MODULE_PARM_DESC(pid, "PID of the process");
+MODULE_PARM_DESC(pid, "PID shown by /proc/psvis until a PID is written to it, 0 for all");
 
-void traverse_proc_tree(struct task_struct* ts, int depth){
-   struct list_head *list;
-   struct task_struct *child;
+/*
+ * The module stays loaded and serves trees through /proc/psvis: a reader
+ * writes a PID to its open file, then reads the tree of that PID, or of
+ * the whole system for PID 0.
+ *
+ * The tree is copied into a snapshot in one pass under tasklist_lock,
+ * with an explicit stack instead of recursion, so deep trees cannot
+ * overflow the kernel stack. That pass only records the PIDs and takes a
+ * reference on each task; usage is read after the lock is dropped, so a
+ * large tree does not hold off fork and exit system-wide. seq_file then prints the snapshot a page per
+ * read() without holding any lock, so wide trees do not stall anything.
+ *
+ * Every entry carries the resource usage of its process and, from one
+ * post-order pass over the snapshot, the totals of its subtree. Usage is
+ * only read for processes the reader may ptrace, like /proc/<pid>/stat
+ * fields, other lines end after the start time.
+ */
+struct psvis_usage {
+   u64 utime, stime; // ns, all threads
+   unsigned long rss; // kB
+   int threads, files, procs;
+};
+
+struct psvis_entry {
+   pid_t pid;
+   int depth;
+   u64 start_time;
+   bool hidden; // the reader may not see its usage
+   struct psvis_usage own, total;
+};
+
+struct psvis_frame {
+   struct task_struct *ts;
+   int depth;
+};
+
+struct psvis_state {
+   int target_pid;
+   bool taken;
+   bool truncated; // more tasks appeared than the snapshot had room for
+   bool missing;
+   struct psvis_entry *entries;
+   int count;
+};
+
+static int psvis_count_tasks(void){
+   struct task_struct *ts;
+   int count = 1; // init_task is not in the task list
+   
+   rcu_read_lock();
+   for_each_process(ts){
+  	count++;
+   }
+   rcu_read_unlock();
+   return count;
+}
+
+static void psvis_add_usage(struct psvis_usage *sum, const struct psvis_usage *u){
+   sum->utime += u->utime;
+   sum->stime += u->stime;
+   sum->rss += u->rss;
+   sum->threads += u->threads;
+   sum->files += u->files;
+   sum->procs += u->procs;
+}
+
+// ts is referenced, no lock needed
+static void psvis_task_usage(struct task_struct *ts, struct psvis_usage *u){
+   struct task_struct *t;
+   
+   memset(u, 0, sizeof(*u));
+   u->procs = 1;
+   u->threads = get_nr_threads(ts);
+   u->utime = ts->signal->utime; // threads that exited
+   u->stime = ts->signal->stime;
+   rcu_read_lock();
+   for_each_thread(ts, t){
+  	u->utime += t->utime;
+  	u->stime += t->stime;
+   }
+   rcu_read_unlock();
+   
+   // mm and files are released under task_lock() on exit
+   task_lock(ts);
+   if (ts->mm){
+  	u->rss = get_mm_rss(ts->mm) << (PAGE_SHIFT - 10);
+   }
+   if (ts->files){
+  	struct fdtable *fdt;
+  	
+  	// the fdtable is replaced under RCU when it grows, as in task_state()
+  	rcu_read_lock();
+  	fdt = files_fdtable(ts->files);
+  	u->files = bitmap_weight(fdt->open_fds, fdt->max_fds);
+  	rcu_read_unlock();
+   }
+   task_unlock(ts);
+}
+
+// children follow their parent in the snapshot, so totals are summed in reverse
+static void psvis_sum_subtrees(struct psvis_state *st, int max_depth){
+   struct psvis_usage *pending; // finished subtrees per depth, waiting for their parent
+   int i;
+   
+   pending = kvcalloc(max_depth + 2, sizeof(*pending), GFP_KERNEL);
+   if (pending == NULL){
+  	return;
+   }
+   for (i = st->count - 1; i >= 0; i--){
+  	struct psvis_entry *entry = &st->entries[i];
+  	
+  	entry->total = entry->own;
+  	psvis_add_usage(&entry->total, &pending[entry->depth + 1]);
+  	memset(&pending[entry->depth + 1], 0, sizeof(*pending));
+  	psvis_add_usage(&pending[entry->depth], &entry->total);
+   }
+   kvfree(pending);
+}
+
+static int psvis_take_snapshot(struct psvis_state *st){
+   struct task_struct *root, *child;
+   struct psvis_entry *entry;
+   struct psvis_frame *stack;
+   struct task_struct **tasks; // referenced, parallel to st->entries
+   int capacity, top = 0, max_depth = 0, i;
+   
+   if (st->target_pid == 0){
+  	root = &init_task;
+  	get_task_struct(root);
+   }else{
+  	struct pid *target = find_get_pid(st->target_pid);
+  	root = get_pid_task(target, PIDTYPE_PID);
+  	put_pid(target);
+   }
+   if (root == NULL){
+  	return -ESRCH;
+   }
+   
+   // room for the tasks forked while allocating
+   capacity = psvis_count_tasks() + 1024;
+   st->entries = kvmalloc_array(capacity, sizeof(*st->entries), GFP_KERNEL);
+   stack = kvmalloc_array(capacity, sizeof(*stack), GFP_KERNEL);
+   tasks = kvmalloc_array(capacity, sizeof(*tasks), GFP_KERNEL);
+   if (st->entries == NULL || stack == NULL || tasks == NULL){
+  	kvfree(st->entries);
+  	kvfree(stack);
+  	kvfree(tasks);
+  	st->entries = NULL;
+  	put_task_struct(root);
+  	return -ENOMEM;
+   }
+   
+   // the children lists are not RCU safe, fork and exit change them under tasklist_lock
+   read_lock(&tasklist_lock);
+   stack[top].ts = root;
+   stack[top++].depth = 0;
+   while (top > 0){
+  	struct psvis_frame frame = stack[--top];
+  	
+  	if (st->count == capacity){
+  	    st->truncated = true;
+  	    break;
+  	}
+  	entry = &st->entries[st->count];
+  	entry->pid = frame.ts->pid;
+  	entry->depth = frame.depth;
+  	entry->start_time = frame.ts->start_time;
+  	get_task_struct(frame.ts);
+  	tasks[st->count++] = frame.ts;
+  	if (frame.depth > max_depth){
+  	    max_depth = frame.depth;
+  	}
+  	
+  	// youngest pushed first, so the eldest child comes out first
+  	list_for_each_entry_reverse(child, &frame.ts->children, sibling){
+  	    if (top == capacity){
+  		st->truncated = true;
+  		break;
+  	    }
+  	    stack[top].ts = child;
+  	    stack[top++].depth = frame.depth + 1;
+  	}
+   }
+   read_unlock(&tasklist_lock);
+   kvfree(stack);
+   put_task_struct(root);
+   
+   // permission checks and usage need task_lock() and thread walks, kept out of tasklist_lock
+   for (i = 0; i < st->count; i++){
+  	entry = &st->entries[i];
+  	entry->hidden = !ptrace_may_access(tasks[i], PTRACE_MODE_READ_FSCREDS);
+  	if (entry->hidden){
+  	    memset(&entry->own, 0, sizeof(entry->own));
+  	    entry->own.procs = 1;
+  	}else{
+  	    psvis_task_usage(tasks[i], &entry->own);
+  	}
+  	put_task_struct(tasks[i]);
+  	cond_resched();
+   }
+   kvfree(tasks);
    
+   psvis_sum_subtrees(st, max_depth);
+   return 0;
+}
+
+static void *psvis_start(struct seq_file *m, loff_t *pos){
+   struct psvis_state *st = m->private;
+   
+   if (!st->taken){
+  	int err = psvis_take_snapshot(st);
+  	
+  	st->taken = true;
+  	if (err == -ESRCH){
+  	    st->missing = true;
+  	}else if (err){
+  	    return ERR_PTR(err);
+  	}
+   }
+   if (*pos < st->count){
+  	return &st->entries[*pos];
+   }
+   if (*pos == st->count && (st->truncated || st->missing)){
+  	return SEQ_START_TOKEN;
+   }
+   return NULL;
+}
+
+static void *psvis_next(struct seq_file *m, void *v, loff_t *pos){
+   struct psvis_state *st = m->private;
+   
+   (*pos)++;
+   if (*pos < st->count){
+  	return &st->entries[*pos];
+   }
+   if (*pos == st->count && (st->truncated || st->missing)){
+  	return SEQ_START_TOKEN;
+   }
+   return NULL;
+}
+
+static void psvis_stop(struct seq_file *m, void *v){
+}
+
+static int psvis_show(struct seq_file *m, void *v){
+   struct psvis_entry *entry = v;
    int i;
-   for(i = 0; i < depth; i++){
-	printk(KERN_CONT "---");	
-	if (i == depth -1 ){
-	printk(KERN_CONT ">");	
+   
+   if (v == SEQ_START_TOKEN){
+  	struct psvis_state *st = m->private;
+  	
+  	if (st->missing){
+  	    seq_printf(m, "Given PID: %d doesnt exist\n", st->target_pid);
+  	}else{
+  	    seq_puts(m, "psvis: tree truncated, processes were forked during the walk\n");
+  	}
+  	return 0;
+   }
+   for(i = 0; i < entry->depth; i++){
+	seq_puts(m, "---");	
+	if (i == entry->depth -1 ){
+	seq_putc(m, '>');	
 	}
    }
+   seq_printf(m, "%d - PID: %d (start time: %lld)", entry->depth, entry->pid, entry->start_time);
+   if (entry->hidden){
+  	seq_putc(m, '\n');
+  	return 0;
+   }
+   // cpu times in ms
+   seq_printf(m, " utime=%llu stime=%llu rss=%lu threads=%d files=%d",
+  	div_u64(entry->own.utime, NSEC_PER_MSEC), div_u64(entry->own.stime, NSEC_PER_MSEC),
+  	entry->own.rss, entry->own.threads, entry->own.files);
+   seq_printf(m, " | subtree procs=%d utime=%llu stime=%llu rss=%lu threads=%d files=%d\n",
+  	entry->total.procs, div_u64(entry->total.utime, NSEC_PER_MSEC),
+  	div_u64(entry->total.stime, NSEC_PER_MSEC), entry->total.rss, entry->total.threads,
+  	entry->total.files);
+   return 0;
+}
+
+static const struct seq_operations psvis_seq_ops = {
+   .start = psvis_start,
+   .next = psvis_next,
+   .stop = psvis_stop,
+   .show = psvis_show,
+};
+
+static int psvis_open(struct inode *inode, struct file *file){
+   struct psvis_state *st = __seq_open_private(file, &psvis_seq_ops, sizeof(*st));
    
+   if (st == NULL){
+  	return -ENOMEM;
+   }
+   st->target_pid = pid;
+   return 0;
+}
+
+static ssize_t psvis_write(struct file *file, const char __user *buf, size_t count, loff_t *ppos){
+   struct seq_file *m = file->private_data;
+   struct psvis_state *st = m->private;
+   int target_pid;
+   int err = kstrtoint_from_user(buf, count, 10, &target_pid);
    
-   printk(KERN_CONT "%d - PID: %d (start time: %lld)\n", depth, ts->pid, ts->start_time);
-  
-   list_for_each(list, &ts->children){
-         child = list_entry(list, struct task_struct, sibling);
-         traverse_proc_tree(child, depth+1);
+   if (err){
+  	return err;
+   }
+   if (target_pid < 0){
+  	return -EINVAL;
    }
+   // the next read walks the new PID, seq_read() holds m->lock while using entries
+   mutex_lock(&m->lock);
+   kvfree(st->entries);
+   st->entries = NULL;
+   st->count = 0;
+   st->taken = false;
+   st->truncated = false;
+   st->missing = false;
+   st->target_pid = target_pid;
+   mutex_unlock(&m->lock);
+   return count;
+}
+
+static int psvis_release(struct inode *inode, struct file *file){
+   struct seq_file *m = file->private_data;
+   struct psvis_state *st = m->private;
    
+   kvfree(st->entries);
+   return seq_release_private(inode, file);
 }
 
+static const struct proc_ops psvis_ops = {
+   .proc_open = psvis_open,
+   .proc_read = seq_read,
+   .proc_write = psvis_write,
+   .proc_lseek = seq_lseek,
+   .proc_release = psvis_release,
+};
+
 int psvis_init(void){
   
-   struct task_struct *ts;
-   ts = get_pid_task(find_get_pid(pid), PIDTYPE_PID);
-  
-   if (ts != NULL){
-  	traverse_proc_tree(ts, 0);
-   }else{
-  	printk("Given PID: %d doesnt exist\n", pid);
-  	return 1;
+   if (proc_create("psvis", 0644, NULL, &psvis_ops) == NULL){
+  	printk("psvis: cannot create /proc/psvis\n");
+  	return -ENOMEM;
    }
    return 0;
 }
 
 void psvis_exit(void){
+   remove_proc_entry("psvis", NULL);
    printk("Leaving psvis...\n");
 }
 
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE // pipe2
 #include <errno.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -11,11 +12,91 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <spawn.h>
+#include <pthread.h>
 
 #define GAME_ARRAY_SIZE 30 // for fibonacci game
+#define FIB_TABLE_SIZE 94  // F(93) is the largest Fibonacci number in 64 bits
+#define BIGNUM_BASE 1000000000u // decimal limbs of 9 digits, printed without conversion
+#define BIGNUM_KARATSUBA 40     // limbs, schoolbook multiplication below
+#define FIB_RECURSION_MAX 45    // fib -b baseline, the recursion takes seconds beyond
+#define FIB_N_MAX 10000000UL    // largest fib -n/-b N, about 2 million digits
+#define SCHED_WHEEL_BITS 6   // 64 slots per timer wheel level
+#define SCHED_WHEEL_LEVELS 4 // one second ticks, 2^24 s (194 days) before clamping
+#define EXEC_CACHE_BUCKETS 256 // for command -> path hash table
+#define IO_BLOCK_SIZE (1 << 20)  // read size for streaming builtins
+#define OUT_BUF_SIZE (1 << 16)   // batched write size for streaming builtins
+#define SORT_DEFAULT_MEM (256UL << 20) // mysort memory cap before spilling runs
+#define SORT_MAX_THREADS 64
+#define SORT_MERGE_FANIN 64 // runs merged at once, bounds the open run files
+#define COMPLETE_MAX_DIRS 32  // directory listings kept for filename completion
+#define COMPLETE_MAX_SHOWN 100 // candidates listed on a double tab
+#define CHAT_MSG_MAX 4096      // longest chat message, header included
+#define CHAT_BROKER_IDLE_MS 5000 // broker lifetime once the room is empty
+#define CHAT_FIFO_QUEUE_MAX (64 << 10) // bytes queued for a slow fifo peer
+#define CHAT_RING_SIZE (1 << 20)  // bytes of message data per shm room
+#define CHAT_RING_ALIGN 32        // record alignment, equal to the header size
+#define CHAT_RING_COMMIT_MS 1000  // wait for a reserved record before skipping it
+#define CHAT_LOG_SEGMENT_MAX (64 << 20) // room log segment size before rotating
+#define CHAT_LOG_SEGMENTS_KEPT 16       // older segments are deleted
+#define CHAT_LOG_INDEX_EVERY 64         // records between sparse index entries
 
 const char *sysname = "shellax";
 
+enum launch_modes
+{
+  LAUNCH_SPAWN = 0, // posix_spawn, fd wiring prepared in the parent
+  LAUNCH_FORK = 1,  // fork the shell for every stage
+};
+
+enum launch_modes launcher_mode = LAUNCH_SPAWN;
+
+enum job_states
+{
+  JOB_RUNNING = 0,
+  JOB_STOPPED = 1,
+  JOB_DONE = 2,
+};
+
+struct job
+{
+  int id;
+  pid_t pgid;
+  pid_t *pids;
+  int process_count, running;
+  int status; // wait status of the last stage
+  enum job_states state;
+  char *cmdline;
+  struct timespec started, finished;
+  struct timeval cpu; // user + system time of all reaped processes
+};
+
+bool shell_interactive = false; // stdin is a terminal we control
+bool shell_batch = false;       // running a script, no prompt or job control
+unsigned long batch_commands = 0; // lines run in batch mode, reported by -t
+bool batch_parse_only = false;    // -p: only parse the lines, to time the parser
+unsigned long arena_mallocs = 0;  // arenas and arena blocks allocated, reported by -p
+int last_status = 0; // exit status of the last foreground command, a batch shell's own
+
 enum return_codes
 {
   SUCCESS = 0,
@@ -23,15 +104,32 @@ enum return_codes
   UNKNOWN = 2,
 };
 
+/*
+ * Bump allocator owning everything parsed from one command line
+ */
+struct arena_block
+{
+  struct arena_block *next;
+  size_t used, cap;
+  char data[];
+};
+
+struct arena
+{
+  struct arena_block *head;
+};
+
 struct command_t
 {
   char *name;
   bool background;
   bool auto_complete;
   int arg_count;
-  char **args;
+  char **args;            // arguments, points into argv
+  char **argv;            // name, arguments and NULL, ready for exec
   char *redirects[3];     // in/out redirection
   struct command_t *next; // for piping
+  struct arena *arena;    // set on the first command of a line only
 };
 
 /**
@@ -59,782 +157,7194 @@ void print_command(struct command_t *command)
   }
 }
 /**
- * Release allocated memory of a command
- * @param  command [description]
- * @return         [description]
+ * Allocate from an arena, memory is only released by arena_free()
+ * @param  a    arena
+ * @param  size bytes needed
+ * @return      pointer aligned for any type
  */
-int free_command(struct command_t *command)
+void *arena_alloc(struct arena *a, size_t size)
 {
-  if (command->arg_count)
+  size = (size + 15) & ~(size_t)15;
+  struct arena_block *b = a->head;
+  if (b == NULL || b->cap - b->used < size)
   {
-    for (int i = 0; i < command->arg_count; ++i)
-      free(command->args[i]);
-    free(command->args);
+    size_t cap = size > 4096 ? size : 4096;
+    b = malloc(sizeof(struct arena_block) + cap);
+    arena_mallocs++;
+    b->cap = cap;
+    b->used = 0;
+    b->next = a->head;
+    a->head = b;
   }
-  for (int i = 0; i < 3; ++i)
-    if (command->redirects[i])
-      free(command->redirects[i]);
-  if (command->next)
+  void *p = b->data + b->used;
+  b->used += size;
+  return p;
+}
+
+void arena_free(struct arena *a)
+{
+  struct arena_block *b = a->head;
+  while (b)
   {
-    free_command(command->next);
-    command->next = NULL;
+    struct arena_block *next = b->next;
+    free(b);
+    b = next;
   }
-  free(command->name);
+  free(a);
+}
+
+/**
+ * Release allocated memory of a command
+ * The whole pipeline lives in the arena of the first command.
+ * @param  command first command of the line
+ * @return         0
+ */
+int free_command(struct command_t *command)
+{
+  if (command->arena)
+    arena_free(command->arena);
   free(command);
   return 0;
 }
+bool chat_show_prompt();
+
 /**
  * Show the command prompt
  * @return [description]
  */
 int show_prompt()
 {
+  if (chat_show_prompt())
+    return 0;
   char cwd[1024], hostname[1024];
   gethostname(hostname, sizeof(hostname));
   getcwd(cwd, sizeof(cwd));
   printf("%s@%s:%s %s$ ", getenv("USER"), hostname, cwd, sysname);
   return 0;
 }
+static char *parse_token(char **cursor, int *op);
+
 /**
  * Parse a command string into a command struct
- * @param  buf     [description]
- * @param  command [description]
+ * Single pass over an arena copy of the line: tokens are unquoted in place
+ * and used as slices of that copy, pipe stages are allocated from the same
+ * arena so the whole line is freed at once by free_command().
+ * @param  buf     command line, not modified
+ * @param  command first command to fill
  * @return         0
  */
 int parse_command(char *buf, struct command_t *command)
 {
-  const char *splitters = " \t"; // split at whitespace
-  int index, len;
-  len = strlen(buf);
-  while (len > 0 && strchr(splitters, buf[0]) != NULL) // trim left whitespace
-  {
-    buf++;
-    len--;
-  }
-  while (len > 0 && strchr(splitters, buf[len - 1]) != NULL)
-    buf[--len] = 0; // trim right whitespace
+  struct arena *arena = calloc(1, sizeof(struct arena));
+  arena_mallocs++;
+  size_t len = strlen(buf);
+  char *line = arena_alloc(arena, len + 1);
+  memcpy(line, buf, len + 1);
 
-  if (len > 0 && buf[len - 1] == '?') // auto-complete
+  while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t'))
+    len--; // trim right whitespace
+  if (len > 0 && line[len - 1] == '?') // auto-complete
     command->auto_complete = true;
-  if (len > 0 && buf[len - 1] == '&') // background
-    command->background = true;
-
-  char *pch = strtok(buf, splitters);
-  if (pch == NULL)
-  {
-    command->name = (char *)malloc(1);
-    command->name[0] = 0;
-  }
-  else
-  {
-    command->name = (char *)malloc(strlen(pch) + 1);
-    strcpy(command->name, pch);
-  }
 
-  command->args = (char **)malloc(sizeof(char *));
-
-  int redirect_index;
-  int target_saved = -1;
-  int arg_index = 0;
-  char temp_buf[1024], *arg;
+  command->arena = arena;
+  struct command_t *stage = command;
+  int argv_cap = 8;
+  stage->argv = arena_alloc(arena, sizeof(char *) * argv_cap);
+  int argc = 0;
+  char *cursor = line;
   while (1)
   {
-
-    // tokenize input on splitters
-    pch = strtok(NULL, splitters);
-    if (!pch)
-      break;
-    arg = temp_buf;
-    strcpy(arg, pch);
-    len = strlen(arg);
-
-    if (len == 0)
-      continue;                                          // empty arg, go for next
-    while (len > 0 && strchr(splitters, arg[0]) != NULL) // trim left whitespace
-    {
-      arg++;
-      len--;
-    }
-    while (len > 0 && strchr(splitters, arg[len - 1]) != NULL)
-      arg[--len] = 0; // trim right whitespace
-    if (len == 0)
-      continue; // empty arg, go for next
-
-    // piping to another command
-    if (strcmp(arg, "|") == 0)
-    {
-      struct command_t *c = malloc(sizeof(struct command_t));
-      int l = strlen(pch);
-      pch[l] = splitters[0]; // restore strtok termination
-      index = 1;
-      while (pch[index] == ' ' || pch[index] == '\t')
-        index++; // skip whitespaces
-
-      parse_command(pch + index, c);
-      pch[l] = 0; // put back strtok termination
-      command->next = c;
-      continue;
-    }
-
-    // background process
-    if (strcmp(arg, "&") == 0)
-      continue; // handled before
-
-    // handle input redirection
-    redirect_index = -1;
-    if (arg[0] == '<')
-      redirect_index = 0;
-
-    if (arg[0] == '>')
+    int op;
+    char *token = parse_token(&cursor, &op);
+    if (token != NULL)
     {
-      if (len > 1 && arg[1] == '>')
+      if (argc + 1 >= argv_cap) // keep room for the NULL
       {
-        redirect_index = 2;
-        arg++;
-        len--;
+        char **grown = arena_alloc(arena, sizeof(char *) * argv_cap * 2);
+        memcpy(grown, stage->argv, sizeof(char *) * argc);
+        stage->argv = grown;
+        argv_cap *= 2;
       }
+      stage->argv[argc++] = token;
+    }
+    while (op == '<' || op == '>' || op == 'A') // redirect, target is next word
+    {
+      int redirect_index = op == '<' ? 0 : op == '>' ? 1 : 2;
+      char *target = parse_token(&cursor, &op);
+      if (target == NULL)
+        printf("-%s: syntax error near redirection\n", sysname);
       else
-        redirect_index = 1;
+        stage->redirects[redirect_index] = target;
     }
-    if (redirect_index != -1)
+    if (op == 0)
+      continue;
+    if (op == '&') // background process
     {
-      command->redirects[redirect_index] = malloc(len);
-      strcpy(command->redirects[redirect_index], arg + 1);
+      command->background = true;
       continue;
     }
 
-    // normal arguments
-    if (len > 2 &&
-        ((arg[0] == '"' && arg[len - 1] == '"') ||
-         (arg[0] == '\'' && arg[len - 1] == '\''))) // quote wrapped arg
-    {
-      arg[--len] = 0;
-      arg++;
-    }
-    command->args =
-        (char **)realloc(command->args, sizeof(char *) * (arg_index + 1));
-    command->args[arg_index] = (char *)malloc(len + 1);
-    strcpy(command->args[arg_index++], arg);
+    // end of a stage, either a pipe or the end of the line
+    stage->argv[argc] = NULL;
+    stage->name = argc > 0 ? stage->argv[0] : "";
+    stage->args = stage->argv + (argc > 0);
+    stage->arg_count = argc > 0 ? argc - 1 : 0;
+    if (op != '|')
+      break;
+    stage->next = arena_alloc(arena, sizeof(struct command_t));
+    memset(stage->next, 0, sizeof(struct command_t));
+    stage = stage->next;
+    argv_cap = 8;
+    stage->argv = arena_alloc(arena, sizeof(char *) * argv_cap);
+    argc = 0;
   }
-  command->arg_count = arg_index;
-
   return 0;
 }
 
-void prompt_backspace()
-{
-  putchar(8);   // go back 1
-  putchar(' '); // write empty over
-  putchar(8);   // go back 1 again
-}
 /**
- * Prompt a command from the user
- * @param  buf      [description]
- * @param  buf_size [description]
- * @return          [description]
+ * Read the next word and the operator following it, quotes and escapes are
+ * removed in place
+ * @param  cursor position in the line, advanced past the token
+ * @param  op     set to '|', '<', '>', 'A' (>>), '&', 'E' at the end of the
+ *                line, or 0 if the word is not followed by an operator
+ * @return        NUL terminated word inside the line, NULL if there is none
  */
-int prompt(struct command_t *command)
+static char *parse_token(char **cursor, int *op)
 {
-  int index = 0;
-  char c;
-  char buf[4096];
-  static char oldbuf[4096];
-
-  // tcgetattr gets the parameters of the current terminal
-  // STDIN_FILENO will tell tcgetattr that it should write the settings
-  // of stdin to oldt
-  static struct termios backup_termios, new_termios;
-  tcgetattr(STDIN_FILENO, &backup_termios);
-  new_termios = backup_termios;
-  // ICANON normally takes care that one line at a time will be processed
-  // that means it will return if it sees a "\n" or an EOF or an EOL
-  new_termios.c_lflag &=
-      ~(ICANON |
-        ECHO); // Also disable automatic echo. We manually echo each char.
-  // Those new settings will be set to STDIN
-  // TCSANOW tells tcsetattr to change attributes immediately.
-  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+  char *p = *cursor;
+  while (*p == ' ' || *p == '\t')
+    p++;
 
-  show_prompt();
-  buf[0] = 0;
-  while (1)
+  char *word = p, *out = p; // out never passes p, so unquote in place
+  char quote = 0;
+  while (*p)
   {
-    c = getchar();
-    // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
-
-    if (c == 9) // handle tab
+    char c = *p;
+    if (quote == '\'')
     {
-      buf[index++] = '?'; // autocomplete
-      break;
+      p++;
+      if (c == '\'')
+        quote = 0;
+      else
+        *out++ = c;
+      continue;
     }
-
-    if (c == 127) // handle backspace
+    if (c == '\\' && p[1] != 0 &&
+        (quote == 0 || strchr("\"\\$`", p[1]) != NULL))
     {
-      if (index > 0)
-      {
-        prompt_backspace();
-        index--;
-      }
+      *out++ = p[1];
+      p += 2;
       continue;
     }
-
-    if (c == 27 || c == 91 || c == 66 || c == 67 || c == 68)
+    if (quote == '"')
     {
+      p++;
+      if (c == '"')
+        quote = 0;
+      else
+        *out++ = c;
       continue;
     }
+    if (c == ' ' || c == '\t' || c == '|' || c == '<' || c == '>' || c == '&')
+      break; // operators end a word even without whitespace
+    p++;
+    if (c == '\'' || c == '"')
+      quote = c;
+    else
+      *out++ = c;
+  }
+  bool is_word = p != word;
 
-    if (c == 65) // up arrow
+  // look at what ends the word before terminating it, the NUL may land on it
+  while (*p == ' ' || *p == '\t')
+    p++;
+  *op = 0;
+  if (*p == 0)
+    *op = 'E';
+  else if (*p == '|' || *p == '<' || *p == '&' || *p == '>')
+  {
+    *op = *p++;
+    if (*op == '>' && *p == '>')
     {
-      while (index > 0)
-      {
-        prompt_backspace();
-        index--;
-      }
-
-      char tmpbuf[4096];
-      printf("%s", oldbuf);
-      strcpy(tmpbuf, buf);
-      strcpy(buf, oldbuf);
-      strcpy(oldbuf, tmpbuf);
-      index += strlen(buf);
-      continue;
+      *op = 'A';
+      p++;
     }
-
-    putchar(c); // echo the character
-    buf[index++] = c;
-    if (index >= sizeof(buf) - 1)
-      break;
-    if (c == '\n') // enter key
-      break;
-    if (c == 4) // Ctrl+D
-      return EXIT;
   }
-  if (index > 0 && buf[index - 1] == '\n') // trim newline from the end
-    index--;
-  buf[index++] = '\0'; // null terminate string
-
-  strcpy(oldbuf, buf);
-
-  parse_command(buf, command);
-
-  // print_command(command); // DEBUG: uncomment for debugging
-
-  // restore the old settings
-  tcsetattr(STDIN_FILENO, TCSANOW, &backup_termios);
-  return SUCCESS;
+  *cursor = p;
+  if (!is_word)
+    return NULL;
+  *out = 0;
+  return word;
 }
-int process_command(struct command_t *command);
-void redirection_part2(struct command_t *command);
-int chatroom(struct command_t *command);
-int pomodoro(struct command_t *command);
-int fib(int n);
-void fibonacci_game(int arr[]);
-int main()
+
+#ifdef SHELLAX_FUZZ
+/**
+ * libFuzzer entry point for the parser, built with
+ * clang -DSHELLAX_FUZZ -fsanitize=fuzzer,address shellax-skeleton.c -lpthread
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
 {
-  while (1)
+  char *line = malloc(size + 1);
+  memcpy(line, data, size);
+  line[size] = '\0';
+  struct command_t *command = calloc(1, sizeof(struct command_t));
+  parse_command(line, command);
+  for (struct command_t *stage = command; stage; stage = stage->next)
   {
-    struct command_t *command = malloc(sizeof(struct command_t));
-    memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
-
-    int code;
-    code = prompt(command);
-    if (code == EXIT)
-      break;
-
-    code = process_command(command);
-    if (code == EXIT)
-      break;
-
-    free_command(command);
+    // whatever the input, every stage is a NULL terminated argv
+    int argc = stage->arg_count + (stage->argv[0] != NULL);
+    if (stage->name == NULL || stage->argv[argc] != NULL ||
+        (argc > 0 && stage->name != stage->argv[0]) || stage->args != stage->argv + (argc > 0))
+      abort();
+    for (int i = 0; i < argc; i++)
+      if (strlen(stage->argv[i]) > size)
+        abort();
   }
-
-  printf("\n");
+  free_command(command);
+  free(line);
   return 0;
 }
+#endif
 
-int process_command(struct command_t *command)
+/*
+ * Persistent command history.
+ * The history file is append-only, every accepted line is written with a
+ * single O_APPEND write so concurrent sessions do not interleave. At
+ * startup the file is only mmap'ed: line offsets are found lazily, newest
+ * first, while the user walks back, so startup cost does not depend on the
+ * file size and going k entries back costs O(k) once, O(1) afterwards.
+ */
+struct history_entry
 {
-  int r;
-  if (strcmp(command->name, "") == 0)
-    return SUCCESS;
+  size_t offset, len;
+};
 
-  if (strcmp(command->name, "exit") == 0)
-    return EXIT;
+static struct
+{
+  int fd; // append end of the history file, -1 if unavailable
+  const char *map; // file contents at startup
+  size_t map_len;
+  size_t scan_end; // map[0, scan_end) is not indexed yet
+  struct history_entry *index; // entries of the map found so far, newest first
+  size_t indexed, index_cap;
+  char **session; // lines added by this shell, oldest first
+  size_t session_count, session_cap;
+} history = {-1};
 
-  if (strcmp(command->name, "cd") == 0)
+/**
+ * Open and map the history file, $HISTFILE or ~/.shellax_history
+ */
+void history_open()
+{
+  char path[4096];
+  const char *file = getenv("HISTFILE");
+  if (file == NULL)
   {
-    if (command->arg_count > 0)
-    {
-      r = chdir(command->args[0]);
-      if (r == -1)
-        printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
-      return SUCCESS;
-    }
+    const char *home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.%s_history", home ? home : "/tmp", sysname);
+    file = path;
   }
-
-  if (strcmp(command->name, "chatroom") == 0)
+  history.fd = open(file, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (history.fd == -1)
+    return;
+  struct stat st;
+  if (fstat(history.fd, &st) == 0 && st.st_size > 0)
   {
-    if (command->arg_count == 2)
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, history.fd, 0);
+    if (map != MAP_FAILED)
     {
-      chatroom(command);
+      history.map = map;
+      history.map_len = st.st_size;
+      history.scan_end = st.st_size;
     }
-    return SUCCESS;
   }
+}
 
-  if (strcmp(command->name, "pomodoro") == 0)
+/**
+ * Index one more (older) line of the mapped file
+ * @return false when the start of the file is reached
+ */
+static bool history_index_more()
+{
+  while (history.scan_end > 0)
   {
-    if (command->arg_count == 3)
+    size_t end = history.scan_end;
+    if (history.map[end - 1] == '\n')
+      end--;
+    const char *nl = end > 0 ? memrchr(history.map, '\n', end) : NULL;
+    size_t start = nl ? (size_t)(nl - history.map) + 1 : 0;
+    history.scan_end = start;
+    if (end == start)
+      continue; // skip empty lines
+    if (history.indexed == history.index_cap)
     {
-      pomodoro(command);
+      history.index_cap = history.index_cap ? history.index_cap * 2 : 256;
+      history.index = realloc(history.index,
+                              sizeof(struct history_entry) * history.index_cap);
     }
-    return SUCCESS;
-  }
-  
-  if(strcmp(command->name, "psvis") == 0 ){
-  
-  	if(command->arg_count == 2){
-  	
-  	     pid_t pid_dmesg = fork();
-  	     
-  	     if(pid_dmesg == 0){
-  	     	char *clear_msg_cmd[] = {"sudo", "dmesg", "-c", NULL};
-  	     	execvp(clear_msg_cmd[0], clear_msg_cmd);
-  	     	
-  	     
-  	     }else{
-  		wait(0);
-  	     	pid_t pid_ps = fork();
-  	     
-  	     	if (pid_ps==0){//Loading the psvis module
-  	     	
-  	     		char pass_pid[20];
-  	     		strcpy(pass_pid, "pid=");
-  	     		strcat(pass_pid,command->args[0]);
-  	     		char *cmd_invoke[]={"sudo", "insmod", "psvis.ko", pass_pid, NULL};
-  	     		//printf("invoke\n");
-  	     		execvp(cmd_invoke[0], cmd_invoke);
-  	     	
-  	     
-  	     	}else{
-  	     		wait(0);
-  	     
-  	     		pid_t pid = fork();
-  	     	
-  	     		if (pid == 0){
-  	     		char *com_remove[]={"sudo", "rmmod", "psvis", NULL};
-  	     		//remove kernel
-  	     	
-  	     		execvp(com_remove[0],com_remove);
-  	     		
-  	     		}else{
-  	     			wait(0);
-  	     			//redirect output
-  	     			int out = open(command->args[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    	        		if (out == -1){
-   		 
-     		    			printf("Error opening redirect target file!\n");
-    				}
-    				dup2(out, STDOUT_FILENO); // copy file to stdout
-    				close(out);
-    				char *dmesg_out[]={"sudo", "dmesg",NULL};
-  	     			execvp(dmesg_out[0], dmesg_out);
-  	     			
-  	     	
-  	     		}
-  
-  	     	}
-  	     }
-  	   
-  	
-  	}
-  	return SUCCESS;
-  	
-  }
-
-  if (strcmp(command->name, "fib") == 0)
-  {                                 // fibonacci game
-    int arr[GAME_ARRAY_SIZE] = {0}; // initialization
-    arr[1] = 1;
-    fibonacci_game(arr);
-    getchar();
-    return 0;
+    history.index[history.indexed].offset = start;
+    history.index[history.indexed++].len = end - start;
+    return true;
   }
-  
-  int num_pipes = 0;
-  int status;
-  // PART 2 - piping
-  if (command->next)
-  {
-    struct command_t *tmp = malloc(sizeof(struct command_t));
-    memcpy(tmp, command, sizeof(struct command_t));
+  return false;
+}
 
-    while (tmp->next)
-    {
-      num_pipes++;
-      tmp = tmp->next;
-    }
+/**
+ * Get the k-th most recent history line, 0 being the newest
+ * @param  k    entry number
+ * @param  line set to the line, not NUL terminated
+ * @return      length of the line, -1 if there is no such entry
+ */
+long history_get(size_t k, const char **line)
+{
+  if (k < history.session_count)
+  {
+    *line = history.session[history.session_count - 1 - k];
+    return strlen(*line);
   }
-  //printf("Number of pipes %d\n", num_pipes);
-  //printf("here\n");
-  int fd_pipes[2 * num_pipes];
-  for (int i = 0; i < num_pipes; i++)
+  k -= history.session_count;
+  while (k >= history.indexed)
+    if (!history_index_more())
+      return -1;
+  *line = history.map + history.index[k].offset;
+  return history.index[k].len;
+}
+
+/**
+ * Record a line in memory and append it to the history file
+ */
+void history_add(const char *line)
+{
+  const char *last;
+  long last_len = history_get(0, &last);
+  size_t len = strlen(line);
+  if (len == 0 || (last_len == (long)len && memcmp(last, line, len) == 0))
+    return; // skip empty lines and direct repeats
+  if (history.session_count == history.session_cap)
   {
-    if (pipe(fd_pipes + i * 2) == -1)
-    {
-      printf("Error creating the pipe!\n");
-      return UNKNOWN;
-    }
+    history.session_cap = history.session_cap ? history.session_cap * 2 : 64;
+    history.session = realloc(history.session, sizeof(char *) * history.session_cap);
   }
+  history.session[history.session_count++] = strdup(line);
 
-  for (int i = 0; i < num_pipes + 1; i++)
+  if (history.fd != -1)
   {
-    pid_t pid = fork();
-   
-    if (pid == 0) // child
-    { 
-     
-      //print_command(command);
-      //printf("%d\n", i);
-      // if not last command
-      if (i != num_pipes)
-      {
-        if (command->next)
-        {
-          dup2(fd_pipes[2 * i + 1], STDOUT_FILENO);
-        }
-      }
-      // if not first command, without a read
-      if (i != 0)
-      {
-        dup2(fd_pipes[2 * i - 2], STDIN_FILENO);
-      }
+    char *rec = malloc(len + 1);
+    memcpy(rec, line, len);
+    rec[len] = '\n';
+    write(history.fd, rec, len + 1); // one write, atomic with O_APPEND
+    free(rec);
+  }
+}
 
-      for (int j = 0; j < 2 * num_pipes; j++)
-      {
-        close(fd_pipes[j]);
-      }
+/**
+ * Find the newest history line at or after entry from containing query
+ * @return entry number, -1 if nothing matches
+ */
+long history_search(const char *query, size_t from)
+{
+  size_t qlen = strlen(query);
+  for (size_t k = from;; k++)
+  {
+    const char *line;
+    long len = history_get(k, &line);
+    if (len < 0)
+      return -1;
+    if (memmem(line, len, query, qlen) != NULL)
+      return k;
+  }
+}
 
-      if (strcmp(command->name, "myuniq") == 0)
-      {
-       
-        char line[20][20];
-        int i = 0;
-        char ch;
-        int j = 0;
+void redirection_part2(struct command_t *command);
+int chatroom(struct command_t *command);
+int chatbench(struct command_t *command);
+int pomodoro(struct command_t *command);
+void sched_init();
+void batch_run_string(const char *commands);
+void batch_run_fd(int fd);
+void batch_wait_jobs();
+int sched_builtin(struct command_t *command);
+int wiseman(struct command_t *command);
+int psvis(struct command_t *command);
+int fib(int n);
+int fib_builtin(struct command_t *command);
+void fibonacci_game(int arr[]);
+char *exec_cache_lookup(const char *name);
+int hash_builtin(struct command_t *command);
+int which_builtin(struct command_t *command);
+pid_t spawn_stage(struct command_t *command, char *exec_path, char **argv,
+                  int in_fd, int out_fd, pid_t pgid, bool foreground);
+int launcher_builtin(struct command_t *command);
+int complete_builtin(struct command_t *command);
+void jobs_init();
+void jobs_reap();
+void jobs_notify();
+void job_signal_set(sigset_t *set);
+void job_default_signals();
+struct job *job_create(struct command_t *command);
+void job_add_process(struct job *job, pid_t pid);
+void job_remove(struct job *job);
+void job_foreground(struct job *job, bool resume);
+int jobs_builtin(struct command_t *command);
+int fg_builtin(struct command_t *command);
+int bg_builtin(struct command_t *command);
+int wait_builtin(struct command_t *command);
+int myuniq(struct command_t *command);
+int mysort(struct command_t *command);
+void loop_cancel_timer(int timer);
 
-        char buf[400];
-        read(STDIN_FILENO , buf ,  sizeof(buf));
-        int l = 0;
-        char* split_request;
-       
-        split_request = strtok(buf,"\n");
-        while(split_request != NULL)
-        {
-          strcpy(line[l],split_request);
-          l++;
-          i++; //number of lines
-          split_request = strtok(NULL,"\n");
+/*
+ * Event loop.
+ * The shell waits in a single epoll_wait() for terminal input, child exits
+ * (signalfd), timers (timerfd) and any fd a builtin registers, so
+ * asynchronous output is shown without waiting for a keystroke.
+ */
+typedef void (*loop_fd_cb)(int fd, uint32_t events, void *data);
+typedef void (*loop_timer_cb)(int timer, void *data);
 
-        }
-        
-        int tot = i;
-        int check = 0; //flag var
-        int count2 = 0; //for number of occurences
-        for (int i = 0; i <= tot; ++i){ 
-          if(check!=0){ 
-               if((command->arg_count>0) && (((strcmp(command->args[0],"-c")==0)) || (strcmp(command->args[0],"--count")==0))){
-                   printf("%d %s\n",count2,line[i-1]);  
-               }
-               else{
-                 printf("%s\n",line[i-1]);
-               }
-
-               count2 = 1;
-              
-          }
-          if(check==0){
-            count2++;
-          }
-          check = strcmp(line[i],line[i+1]); //check if consecutive strings are equal
-        }
-      }
+struct loop_handler
+{
+  loop_fd_cb fd_cb;
+  loop_timer_cb timer_cb; // set for timers made by loop_add_timer()
+  void *data;
+  bool oneshot;
+  bool always_ready; // regular files cannot be polled, they are always ready
+};
 
+static struct
+{
+  int epfd;
+  struct loop_handler *handlers; // indexed by fd
+  int size;
+  int always_ready_count;
+} loop = {-1};
 
-      if (strcmp(command->name, "wiseman") == 0){
-    
-        printf("wiseman will speak for every %s minutes.\n",command->args[0]);
-        FILE *cronjob_hw_file = fopen("cronjob.txt", "w");
-        fprintf(cronjob_hw_file, "SHELL=/bin/bash\n");
-        fprintf(cronjob_hw_file, "PATH=%s\n", getenv("PATH"));
-      
-        fprintf(cronjob_hw_file, "*/%s* * * * *  fortune | espeak \n",command->args[0]);
-        fclose(cronjob_hw_file);
-        command->name = "crontab";
-        command->args[0] = "cronjob.txt";
- 
-  }
-  
-      redirection_part2(command);
+bool shell_running = true;
 
-      /// This shows how to do exec with environ (but is not available on MacOs)
-      // extern char** environ; // environment variables
-      // execvpe(command->name, command->args, environ); // exec+args+path+environ
+void loop_init()
+{
+  loop.epfd = epoll_create1(EPOLL_CLOEXEC);
+}
 
-      /// This shows how to do exec with auto-path resolve
-      // add a NULL argument to the end of args, and the name to the beginning
-      // as required by exec
+/**
+ * Call cb whenever fd is ready
+ * @param  fd     file descriptor to watch
+ * @param  events EPOLLIN and/or EPOLLOUT
+ * @param  cb     called with the ready events
+ * @param  data   passed to cb
+ * @return        0, -1 on error
+ */
+int loop_add_fd(int fd, uint32_t events, loop_fd_cb cb, void *data)
+{
+  if (fd >= loop.size)
+  {
+    int size = fd + 16;
+    loop.handlers = realloc(loop.handlers, sizeof(struct loop_handler) * size);
+    memset(loop.handlers + loop.size, 0, sizeof(struct loop_handler) * (size - loop.size));
+    loop.size = size;
+  }
+  struct loop_handler *h = &loop.handlers[fd];
+  memset(h, 0, sizeof(struct loop_handler));
+  struct epoll_event ev = {0};
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(loop.epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+  {
+    if (errno != EPERM)
+      return -1;
+    h->always_ready = true;
+    loop.always_ready_count++;
+  }
+  h->fd_cb = cb;
+  h->data = data;
+  return 0;
+}
 
-      // increase args size by 2
-      command->args = (char **)realloc(
-          command->args, sizeof(char *) * (command->arg_count += 2));
+/**
+ * Change the events watched on a registered fd
+ */
+void loop_modify_fd(int fd, uint32_t events)
+{
+  struct epoll_event ev = {0};
+  ev.events = events;
+  ev.data.fd = fd;
+  epoll_ctl(loop.epfd, EPOLL_CTL_MOD, fd, &ev);
+}
 
-      // shift everything forward by 1
-      for (int i = command->arg_count - 2; i > 0; --i)
-        command->args[i] = command->args[i - 1];
+void loop_remove_fd(int fd)
+{
+  if (fd < 0 || fd >= loop.size || loop.handlers[fd].fd_cb == NULL)
+    return;
+  if (loop.handlers[fd].always_ready)
+    loop.always_ready_count--;
+  else
+    epoll_ctl(loop.epfd, EPOLL_CTL_DEL, fd, NULL);
+  memset(&loop.handlers[fd], 0, sizeof(struct loop_handler));
+}
 
-      // set args[0] as a copy of name
-      command->args[0] = strdup(command->name);
-      // set args[arg_count-1] (last) to NULL
-      command->args[command->arg_count - 1] = NULL;
+static void loop_timer_ready(int fd, uint32_t events, void *data)
+{
+  uint64_t expirations;
+  if (read(fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    return;
+  struct loop_handler h = loop.handlers[fd];
+  if (h.oneshot) // gone before the callback, which may reuse the id
+    loop_cancel_timer(fd);
+  h.timer_cb(fd, h.data);
+}
 
-      // TODO: do your own exec with path resolving using execv()
-      // do so by replacing the execvp call below
-      // execvp(command->name, command->args); // exec+args+path
-      // PART 1
-      // print_command(command);
-      char bin_dir[100];
-      strcpy(bin_dir, "/usr/bin/"); // copy for bin direction
-      strcat(bin_dir, command->name);
-      execv(bin_dir, command->args);
+/**
+ * Call cb after first_ms milliseconds, then every interval_ms if non zero
+ * @return timer id for loop_cancel_timer(), -1 on error
+ */
+int loop_add_timer(long first_ms, long interval_ms, loop_timer_cb cb, void *data)
+{
+  int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  struct itimerspec spec = {0};
+  if (first_ms <= 0)
+    first_ms = 1; // zero would disarm the timer
+  spec.it_value.tv_sec = first_ms / 1000;
+  spec.it_value.tv_nsec = (first_ms % 1000) * 1000000;
+  spec.it_interval.tv_sec = interval_ms / 1000;
+  spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+  timerfd_settime(fd, 0, &spec, NULL);
+  loop_add_fd(fd, EPOLLIN, loop_timer_ready, NULL);
+  loop.handlers[fd].timer_cb = cb;
+  loop.handlers[fd].data = data;
+  loop.handlers[fd].oneshot = interval_ms == 0;
+  return fd;
+}
 
-      exit(0);
-    }
-    if (command->next)
-    {
-      command = command->next;
-      continue;
-    }
-  }
-  // TODO: implement background processes here
+void loop_cancel_timer(int timer)
+{
+  loop_remove_fd(timer);
+  close(timer);
+}
 
-  for (int j = 0; j < 2 * num_pipes; j++)
+/**
+ * Wait for events once and dispatch them
+ * @param timeout_ms -1 to wait forever
+ */
+void loop_iterate(int timeout_ms)
+{
+  struct epoll_event events[64];
+  int n = epoll_wait(loop.epfd, events, 64, loop.always_ready_count ? 0 : timeout_ms);
+  for (int i = 0; i < n; i++)
   {
-    close(fd_pipes[j]);
+    int fd = events[i].data.fd;
+    // an earlier callback may have removed this one
+    if (fd < loop.size && loop.handlers[fd].fd_cb)
+      loop.handlers[fd].fd_cb(fd, events[i].events, loop.handlers[fd].data);
   }
-  for (int k = 0; k < num_pipes + 1; k++)
-  { // wait for child process to finish
-    wait(&status);
-  }
-  return SUCCESS;
-
-  printf("-%s: %s: command not found\n", sysname, command->name);
-  return UNKNOWN;
+  for (int fd = 0; loop.always_ready_count && fd < loop.size; fd++)
+    if (loop.handlers[fd].always_ready && loop.handlers[fd].fd_cb)
+      loop.handlers[fd].fd_cb(fd, EPOLLIN, loop.handlers[fd].data);
 }
 
-// TODO: your implementation here
-void redirection_part2(struct command_t *command)
-{
+bool complete_line(char *buf, int *index, int buf_size, bool list);
+int process_command(struct command_t *command);
+bool chat_active();
+void chat_line(const char *line);
+void chat_leave();
+bool pomodoro_active();
+bool psvis_watching();
+
+/*
+ * Line editor, fed one byte at a time by the event loop
+ */
+enum prompt_modes
+{
+  PROMPT_EDIT = 0,
+  PROMPT_ESC = 1,    // got ESC
+  PROMPT_CSI = 2,    // got ESC [, waiting for the final byte
+  PROMPT_SEARCH = 3, // Ctrl+R reverse search
+};
+
+static struct
+{
+  bool active; // prompt shown, stdin watched
+  enum prompt_modes mode;
+  char buf[4096];
+  int index;
+  char editbuf[4096]; // line being typed while browsing the history
+  int editlen;
+  long hist_pos; // history entry shown, -1 for the edited line
+  int last_key;
+  char query[256]; // reverse search
+  int qlen;
+  long match;
+  struct termios backup_termios;
+} editor;
+
+void prompt_backspace()
+{
+  putchar(8);   // go back 1
+  putchar(' '); // write empty over
+  putchar(8);   // go back 1 again
+}
+
+/**
+ * Clear the current terminal line and show the prompt with buf
+ */
+void prompt_redraw(const char *buf, int len)
+{
+  printf("\r\033[K");
+  show_prompt();
+  fwrite(buf, 1, len, stdout);
+}
+
+static void prompt_show_search()
+{
+  const char *line = "";
+  long len = editor.match != -1 ? history_get(editor.match, &line) : 0;
+  printf("\r\033[K(reverse-i-search)`%s': %.*s", editor.query, (int)len, line);
+}
+
+/**
+ * Clear the prompt line before printing something asynchronously
+ */
+void prompt_interrupt_begin()
+{
+  if (editor.active)
+    printf("\r\033[K");
+}
+
+/**
+ * Put the prompt and the half typed line back after async output
+ */
+void prompt_interrupt_end()
+{
+  if (editor.active)
+  {
+    if (editor.mode == PROMPT_SEARCH)
+      prompt_show_search();
+    else
+      prompt_redraw(editor.buf, editor.index);
+  }
+  fflush(stdout);
+}
+
+/**
+ * Leave the reverse search with the match in the line buffer
+ */
+static void prompt_end_search(bool keep)
+{
+  const char *line = "";
+  long len = keep && editor.match != -1 ? history_get(editor.match, &line) : 0;
+  if (len >= (long)sizeof(editor.buf))
+    len = sizeof(editor.buf) - 1;
+  memcpy(editor.buf, line, len);
+  editor.index = len;
+  editor.mode = PROMPT_EDIT;
+  prompt_redraw(editor.buf, editor.index);
+}
+
+/**
+ * Ctrl+R incremental reverse search, typed characters refine the query,
+ * Ctrl+R again goes to the next older match
+ * @return true if the match should be run right away (enter)
+ */
+static bool prompt_search_key(int c)
+{
+  if (c == 18) // Ctrl+R, next older match
+  {
+    long next = editor.qlen ? history_search(editor.query, editor.match + 1) : -1;
+    if (next != -1)
+      editor.match = next;
+  }
+  else if (c == 127 || c == 8) // shorten the query, search from newest
+  {
+    if (editor.qlen > 0)
+      editor.query[--editor.qlen] = 0;
+    editor.match = editor.qlen ? history_search(editor.query, 0) : -1;
+  }
+  else if (c >= 32 && c < 127 && editor.qlen < (int)sizeof(editor.query) - 1)
+  {
+    editor.query[editor.qlen++] = c;
+    editor.query[editor.qlen] = 0;
+    // a longer query can only match the current line or older ones
+    editor.match = history_search(editor.query, editor.match == -1 ? 0 : editor.match);
+  }
+  else
+  {
+    prompt_end_search(c != 7); // Ctrl+G gives up
+    return c == '\n';
+  }
+  prompt_show_search();
+  return false;
+}
+
+/**
+ * Up/down arrows walk the history, the typed line is kept at position -1
+ */
+static void prompt_history_key(int c)
+{
+  long next = editor.hist_pos;
+  if (c == 'A') // up arrow
+    next = editor.hist_pos + 1;
+  else if (c == 'B' && editor.hist_pos >= 0) // down arrow
+    next = editor.hist_pos - 1;
+  if (next == editor.hist_pos)
+    return;
+
+  const char *line;
+  long len = next >= 0 ? history_get(next, &line) : -1;
+  if (next >= 0 && len < 0)
+    return; // already at the oldest entry
+  if (editor.hist_pos == -1)
+  {
+    memcpy(editor.editbuf, editor.buf, editor.index);
+    editor.editlen = editor.index;
+  }
+  if (next == -1)
+  {
+    line = editor.editbuf;
+    len = editor.editlen;
+  }
+  if (len >= (long)sizeof(editor.buf))
+    len = sizeof(editor.buf) - 1;
+  memcpy(editor.buf, line, len);
+  editor.index = len;
+  editor.hist_pos = next;
+  prompt_redraw(editor.buf, editor.index);
+}
+
+/**
+ * Handle one input byte
+ * @return SUCCESS while editing, EXIT on Ctrl+D, UNKNOWN when a line is ready
+ */
+static int prompt_feed(int c)
+{
+  // printf("Keycode: %u\n", c); // DEBUG: uncomment for debugging
+  if (editor.mode == PROMPT_SEARCH)
+    return prompt_search_key(c) ? UNKNOWN : SUCCESS;
+  if (editor.mode == PROMPT_ESC)
+  {
+    editor.mode = c == '[' ? PROMPT_CSI : PROMPT_EDIT;
+    return SUCCESS;
+  }
+  if (editor.mode == PROMPT_CSI) // only up/down arrows are used
+  {
+    if ((c >= 'A' && c <= 'Z') || c == '~')
+    {
+      editor.mode = PROMPT_EDIT;
+      prompt_history_key(c);
+    }
+    return SUCCESS;
+  }
+
+  if (c == 4) // Ctrl+D
+    return EXIT;
+
+  if (c == 9) // handle tab, a second tab in a row lists the candidates
+  {
+    if (complete_line(editor.buf, &editor.index, sizeof(editor.buf), editor.last_key == 9))
+      prompt_redraw(editor.buf, editor.index);
+    editor.last_key = c;
+    return SUCCESS;
+  }
+  editor.last_key = c;
+
+  if (c == 127) // handle backspace
+  {
+    if (editor.index > 0)
+    {
+      prompt_backspace();
+      editor.index--;
+    }
+    return SUCCESS;
+  }
+
+  if (c == 18) // Ctrl+R
+  {
+    editor.mode = PROMPT_SEARCH;
+    editor.qlen = 0;
+    editor.query[0] = 0;
+    editor.match = -1;
+    prompt_show_search();
+    return SUCCESS;
+  }
+
+  if (c == 27) // escape sequence
+  {
+    editor.mode = PROMPT_ESC;
+    return SUCCESS;
+  }
+
+  putchar(c); // echo the character
+  if (c == '\n') // enter key
+    return UNKNOWN;
+  editor.buf[editor.index++] = c;
+  if (editor.index >= sizeof(editor.buf) - 1)
+    return UNKNOWN;
+  return SUCCESS;
+}
+
+static void prompt_input(int fd, uint32_t events, void *data);
+
+/**
+ * Show the prompt and start reading a line from the terminal
+ */
+void prompt_start()
+{
+  jobs_notify();
+
+  // tcgetattr gets the parameters of the current terminal
+  // STDIN_FILENO will tell tcgetattr that it should write the settings
+  // of stdin to oldt
+  static struct termios new_termios;
+  tcgetattr(STDIN_FILENO, &editor.backup_termios);
+  new_termios = editor.backup_termios;
+  // ICANON normally takes care that one line at a time will be processed
+  // that means it will return if it sees a "\n" or an EOF or an EOL
+  new_termios.c_lflag &=
+      ~(ICANON |
+        ECHO); // Also disable automatic echo. We manually echo each char.
+  // Those new settings will be set to STDIN
+  // TCSANOW tells tcsetattr to change attributes immediately.
+  tcsetattr(STDIN_FILENO, TCSANOW, &new_termios);
+
+  editor.mode = PROMPT_EDIT;
+  editor.index = 0;
+  editor.hist_pos = -1;
+  editor.last_key = 0;
+  editor.active = true;
+  show_prompt();
+  fflush(stdout);
+  loop_add_fd(STDIN_FILENO, EPOLLIN, prompt_input, NULL);
+}
+
+/**
+ * Stop reading the terminal and restore its settings, e.g. to run a command
+ */
+void prompt_stop()
+{
+  if (!editor.active)
+    return;
+  loop_remove_fd(STDIN_FILENO);
+  // restore the old settings
+  tcsetattr(STDIN_FILENO, TCSANOW, &editor.backup_termios);
+  editor.active = false;
+}
+
+/**
+ * Run a finished line, as a command or as a chat message
+ */
+static void run_line(char *line)
+{
+  if (chat_active())
+  {
+    chat_line(line);
+    return;
+  }
+  history_add(line);
+
+  struct command_t *command = malloc(sizeof(struct command_t));
+  memset(command, 0, sizeof(struct command_t)); // set all bytes to 0
+  parse_command(line, command);
+  // print_command(command); // DEBUG: uncomment for debugging
+  int code = process_command(command);
+  free_command(command);
+  if (code == EXIT)
+    shell_running = false;
+}
+
+/**
+ * Terminal input is ready: feed it to the editor, run complete lines
+ */
+static void prompt_input(int fd, uint32_t events, void *data)
+{
+  char input[4096];
+  ssize_t n = read(fd, input, sizeof(input));
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) // end of input
+  {
+    n = 1;
+    input[0] = 4;
+  }
+  for (ssize_t i = 0; i < n && editor.active; i++)
+  {
+    int code = prompt_feed((unsigned char)input[i]);
+    if (code == SUCCESS)
+      continue;
+    if (code == EXIT && chat_active()) // Ctrl+D leaves the chatroom first
+    {
+      printf("\n");
+      chat_leave();
+      prompt_stop();
+    }
+    else if (code == EXIT)
+    {
+      prompt_stop();
+      shell_running = false;
+      return;
+    }
+    else
+    {
+      editor.buf[editor.index] = '\0'; // null terminate string
+      prompt_stop();
+      run_line(editor.buf);
+    }
+    if (!shell_running)
+      return;
+    fflush(stdout);
+    prompt_start();
+  }
+  fflush(stdout);
+}
+
+#ifndef SHELLAX_FUZZ
+/**
+ * shellax [-t] [-p] [-c commands | script], -t reports commands per
+ * second, -p only parses the lines and reports ns and allocations per line
+ * @return in batch mode the status of the last command, or of exit n
+ */
+int main(int argc, char **argv)
+{
+  const char *commands = NULL, *script = NULL;
+  bool timing = false;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-t") == 0)
+      timing = true;
+    else if (strcmp(argv[i], "-p") == 0)
+      batch_parse_only = timing = true;
+    else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+      commands = argv[++i];
+    else if (script == NULL && commands == NULL)
+      script = argv[i];
+  }
+  shell_batch = commands || script || !isatty(STDIN_FILENO);
+  loop_init();
+  if (shell_batch)
+  {
+    int fd = STDIN_FILENO;
+    if (script && (fd = open(script, O_RDONLY | O_CLOEXEC)) == -1)
+    {
+      printf("-%s: %s: %s\n", sysname, script, strerror(errno));
+      return 127;
+    }
+    jobs_init();
+    sched_init();
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    if (commands)
+      batch_run_string(commands);
+    else
+      batch_run_fd(fd);
+    batch_wait_jobs();
+    while (pomodoro_active() || psvis_watching()) // their timers outlive the script
+      loop_iterate(-1);
+    fflush(stdout);
+    if (timing)
+    {
+      struct timespec end;
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      double seconds = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+      if (batch_parse_only) // + 1 for the command_t of each line
+        fprintf(stderr, "%s: %lu lines parsed in %.3f s, %.0f ns/line, %.2f allocations/line\n",
+                sysname, batch_commands, seconds, seconds * 1e9 / batch_commands,
+                (double)(arena_mallocs + batch_commands) / batch_commands);
+      else
+        fprintf(stderr, "%s: %lu commands in %.3f s, %.0f commands/s\n", sysname,
+                batch_commands, seconds, batch_commands / seconds);
+    }
+    return last_status;
+  }
+
+  history_open();
+  jobs_init();
+  sched_init();
+  prompt_start();
+  while (shell_running)
+    loop_iterate(-1);
+  prompt_stop();
+
+  printf("\n");
+  return 0;
+}
+#endif
+
+/*
+ * Builtins, sorted by name for bsearch(). A builtin alone in the
+ * foreground runs in the shell itself if it can, with its redirections
+ * applied to the shell's fds and undone afterwards. In a pipeline or in
+ * the background it runs in a forked stage like any command, except the
+ * builtins whose state lives in the shell's event loop (timers, chat
+ * fds): a forked copy would lose it on exit, so they are refused there.
+ */
+struct builtin
+{
+  const char *name;
+  int (*run)(struct command_t *command);
+  bool in_process; // false: always forked
+  bool shell_only; // true: never forked
+};
+
+/**
+ * exit [n]: leave the shell, a batch shell exits with n or the last status
+ */
+static int exit_builtin(struct command_t *command)
+{
+  if (command->arg_count > 0)
+    last_status = atoi(command->args[0]) & 0xff;
+  return EXIT;
+}
+
+static int cd_builtin(struct command_t *command)
+{
+  const char *dir = command->arg_count > 0 ? command->args[0] : getenv("HOME");
+  if (dir != NULL && chdir(dir) == -1)
+    printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+  return SUCCESS;
+}
+
+static const struct builtin builtins[] = {
+    {"bg", bg_builtin, true, false},
+    {"cd", cd_builtin, true, false},
+    {"chatbench", chatbench, true, false},
+    {"chatroom", chatroom, true, true},
+    {"complete", complete_builtin, true, false},
+    {"exit", exit_builtin, true, false},
+    {"fg", fg_builtin, true, false},
+    {"fib", fib_builtin, true, false},
+    {"hash", hash_builtin, true, false},
+    {"jobs", jobs_builtin, true, false},
+    {"launcher", launcher_builtin, true, false},
+    {"mysort", mysort, false, false}, // read stdin to the end, Ctrl+C must stop them
+    {"myuniq", myuniq, false, false},
+    {"pomodoro", pomodoro, true, true},
+    {"psvis", psvis, true, false},
+    {"sched", sched_builtin, true, true},
+    {"wait", wait_builtin, true, false},
+    {"which", which_builtin, true, false},
+    {"wiseman", wiseman, true, true},
+};
+
+#define BUILTIN_COUNT (sizeof(builtins) / sizeof(builtins[0]))
+
+static int builtin_compare(const void *name, const void *entry)
+{
+  return strcmp(name, ((const struct builtin *)entry)->name);
+}
+
+/**
+ * @return the builtin called name, NULL for other commands
+ */
+const struct builtin *builtin_lookup(const char *name)
+{
+  return bsearch(name, builtins, BUILTIN_COUNT, sizeof(struct builtin), builtin_compare);
+}
+
+/**
+ * Undo builtin_redirect()
+ */
+static void builtin_restore(int saved[2])
+{
+  fflush(stdout);
+  for (int fd = 0; fd < 2; fd++)
+    if (saved[fd] != -1)
+    {
+      dup2(saved[fd], fd);
+      close(saved[fd]);
+      saved[fd] = -1;
+    }
+}
+
+/**
+ * Point the shell's stdin/stdout at the redirections of an in-process
+ * builtin, same order as redirection_part2()
+ * @param  saved gets copies of the replaced fds for builtin_restore()
+ * @return       0, -1 when a file cannot be opened, nothing is left changed
+ */
+static int builtin_redirect(struct command_t *command, int saved[2])
+{
+  static const int flags[3] = {O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC,
+                               O_WRONLY | O_CREAT | O_APPEND};
+  saved[0] = saved[1] = -1;
+  for (int i = 0; i < 3; i++)
+  {
+    if (command->redirects[i] == NULL)
+      continue;
+    int target = i == 0 ? STDIN_FILENO : STDOUT_FILENO;
+    int fd = open(command->redirects[i], flags[i] | O_CLOEXEC, 0644);
+    if (fd == -1)
+    {
+      printf("-%s: %s: %s\n", sysname, command->redirects[i], strerror(errno));
+      builtin_restore(saved);
+      return -1;
+    }
+    fflush(stdout);
+    if (saved[target] == -1)
+      saved[target] = fcntl(target, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, target);
+    close(fd);
+  }
+  return 0;
+}
+
+int process_command(struct command_t *command)
+{
+  if (strcmp(command->name, "") == 0)
+    return SUCCESS;
+
+  const struct builtin *builtin = builtin_lookup(command->name);
+  if (builtin && builtin->in_process && command->next == NULL && !command->background)
+  {
+    int saved[2];
+    if (builtin_redirect(command, saved) == -1)
+      return UNKNOWN;
+    int code = builtin->run(command);
+    builtin_restore(saved);
+    if (code != EXIT)
+      last_status = code == SUCCESS ? 0 : 2;
+    return code;
+  }
+
+  for (struct command_t *stage = command; stage; stage = stage->next)
+  {
+    const struct builtin *b = builtin_lookup(stage->name);
+    if (b && b->shell_only && (command->next || command->background))
+    {
+      printf("-%s: %s: cannot run in a pipeline or in the background\n", sysname,
+             stage->name);
+      last_status = 2;
+      return UNKNOWN;
+    }
+  }
+
+  int num_pipes = 0;
+  struct command_t *first = command;
+  // PART 2 - piping
+  for (struct command_t *tmp = command->next; tmp; tmp = tmp->next)
+    num_pipes++;
+  //printf("Number of pipes %d\n", num_pipes);
+  //printf("here\n");
+  // O_CLOEXEC: exec'ed stages only keep the ends dup'ed onto their stdin/out
+  int fd_pipes[2 * num_pipes + 1]; // +1: no zero length array without pipes
+  for (int i = 0; i < num_pipes; i++)
+  {
+    if (pipe2(fd_pipes + i * 2, O_CLOEXEC) == -1)
+    {
+      printf("Error creating the pipe!\n");
+      return UNKNOWN;
+    }
+  }
+
+  // every pipeline runs as a job in its own process group
+  struct job *job = job_create(command);
+  bool foreground = !command->background;
+  for (int i = 0; i < num_pipes + 1; i++)
+  {
+    // resolve the executable in the parent so the cache survives the fork
+    char *exec_path = NULL;
+    builtin = builtin_lookup(command->name); // never exec'ed
+    if (builtin == NULL)
+      exec_path = exec_cache_lookup(command->name);
+
+    char **argv = command->argv; // built by parse_command, ready for exec
+    int in_fd = i != 0 ? fd_pipes[2 * i - 2] : -1;
+    int out_fd = i != num_pipes ? fd_pipes[2 * i + 1] : -1;
+
+    if (launcher_mode == LAUNCH_SPAWN && builtin == NULL)
+    {
+      if (exec_path == NULL)
+        printf("-%s: %s: command not found\n", sysname, command->name);
+      else
+      {
+        pid_t pid = spawn_stage(command, exec_path, argv, in_fd, out_fd,
+                                job->pgid, foreground);
+        if (pid != -1)
+          job_add_process(job, pid);
+      }
+      command = command->next;
+      continue;
+    }
+
+    fflush(stdout); // do not let the child inherit pending output
+    pid_t pid = fork();
+   
+    if (pid == 0) // child
+    { 
+      setpgid(0, job->pgid);
+      if (foreground && shell_interactive)
+        tcsetpgrp(STDIN_FILENO, getpgrp());
+      job_default_signals();
+
+      if (out_fd != -1)
+        dup2(out_fd, STDOUT_FILENO);
+      if (in_fd != -1)
+        dup2(in_fd, STDIN_FILENO);
+
+      // internal builtins never exec, so O_CLOEXEC does not help them
+      for (int j = 0; j < 2 * num_pipes; j++)
+      {
+        close(fd_pipes[j]);
+      }
+
+      redirection_part2(command);
+      if (builtin)
+        exit(builtin->run(command));
+
+      // PART 1 - exec with our own path resolving, see exec_cache_lookup()
+      if (exec_path == NULL)
+      {
+        printf("-%s: %s: command not found\n", sysname, command->name);
+        exit(127);
+      }
+      execv(exec_path, argv);
+      printf("-%s: %s: %s\n", sysname, command->name, strerror(errno));
+      exit(126);
+    }
+    if (pid > 0)
+    {
+      setpgid(pid, job->pgid ? job->pgid : pid); // also here, avoids a race
+      job_add_process(job, pid);
+    }
+    command = command->next;
+  }
+
+  for (int j = 0; j < 2 * num_pipes; j++)
+  {
+    close(fd_pipes[j]);
+  }
+  if (job->process_count == 0)
+  {
+    job_remove(job);
+    last_status = 127; // not found
+    return SUCCESS;
+  }
+  if (first->background)
+  {
+    if (!shell_batch) // scripts keep it in the background without a notice
+      printf("[%d] %d\n", job->id, job->pgid);
+    last_status = 0;
+  }
+  else
+    job_foreground(job, false);
+  return SUCCESS;
+}
+
+/**
+ * Start one pipeline stage with posix_spawn, all fd wiring is described as
+ * file actions so the shell is never duplicated
+ * @param  command  stage to start, redirects are taken from it
+ * @param  exec_path resolved executable
+ * @param  argv     argument vector, name first and NULL terminated
+ * @param  in_fd    pipe end to use as stdin, -1 to inherit
+ * @param  out_fd   pipe end to use as stdout, -1 to inherit
+ * @param  pgid     process group to join, 0 to start a new one
+ * @param  foreground give the terminal to the new process group
+ * @return          pid of the child, -1 on error
+ */
+pid_t spawn_stage(struct command_t *command, char *exec_path, char **argv,
+                  int in_fd, int out_fd, pid_t pgid, bool foreground)
+{
+  extern char **environ;
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults, empty;
+  job_signal_set(&defaults);
+  sigemptyset(&empty);
+  short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+  posix_spawnattr_setpgroup(&attr, pgid);
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  posix_spawnattr_setflags(&attr, flags);
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+#if __GLIBC_PREREQ(2, 35)
+  if (foreground && pgid == 0 && shell_interactive) // before exec, no SIGTTIN
+    posix_spawn_file_actions_addtcsetpgrp_np(&actions, STDIN_FILENO);
+#endif
+  if (in_fd != -1)
+    posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+  if (out_fd != -1)
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+  // same order as redirection_part2(), redirects win over pipes
+  if (command->redirects[0] != NULL)
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, command->redirects[0],
+                                     O_RDONLY, 0644);
+  if (command->redirects[1] != NULL)
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, command->redirects[1],
+                                     O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (command->redirects[2] != NULL)
+    posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, command->redirects[2],
+                                     O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+  pid_t pid;
+  fflush(stdout);
+  int r = posix_spawn(&pid, exec_path, &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+  if (r != 0)
+  {
+    printf("-%s: %s: %s\n", sysname, command->name, strerror(r));
+    return -1;
+  }
+  return pid;
+}
+
+/**
+ * Start a pipeline of stages /bin/true processes the way process_command
+ * would in mode, then reap them
+ * @param setup_ms time until every stage is started
+ * @param total_ms time until every stage is reaped
+ */
+static void launcher_bench_round(int stages, enum launch_modes mode, char *exec_path,
+                                 double *setup_ms, double *total_ms)
+{
+  char *argv[] = {"true", NULL};
+  struct command_t stage = {0};
+  stage.name = "true";
+  stage.argv = argv;
+  int fds[2 * (stages - 1) + 1];
+  pid_t pids[stages], pgid = 0;
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  for (int i = 0; i < stages - 1; i++)
+    pipe2(fds + 2 * i, O_CLOEXEC);
+  for (int i = 0; i < stages; i++)
+  {
+    int in_fd = i != 0 ? fds[2 * i - 2] : -1;
+    int out_fd = i != stages - 1 ? fds[2 * i + 1] : -1;
+    if (mode == LAUNCH_SPAWN)
+      pids[i] = spawn_stage(&stage, exec_path, argv, in_fd, out_fd, pgid, false);
+    else if ((pids[i] = fork()) == 0)
+    {
+      setpgid(0, pgid);
+      job_default_signals();
+      if (out_fd != -1)
+        dup2(out_fd, STDOUT_FILENO);
+      if (in_fd != -1)
+        dup2(in_fd, STDIN_FILENO);
+      for (int j = 0; j < 2 * (stages - 1); j++)
+        close(fds[j]);
+      execv(exec_path, argv);
+      _exit(127);
+    }
+    if (pgid == 0)
+      pgid = pids[i];
+  }
+  for (int i = 0; i < 2 * (stages - 1); i++)
+    close(fds[i]);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *setup_ms += (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+  for (int i = 0; i < stages; i++)
+    if (pids[i] > 0)
+      waitpid(pids[i], NULL, 0);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  *total_ms += (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6;
+}
+
+/**
+ * launcher -b [rounds]: average setup and total time of 1 to 64 stage
+ * pipelines of true, posix_spawn against fork/exec
+ */
+static int launcher_bench(int rounds)
+{
+  char *exec_path = exec_cache_lookup("true");
+  if (exec_path == NULL)
+  {
+    printf("-%s: launcher: true: command not found\n", sysname);
+    return UNKNOWN;
+  }
+  printf("stages  spawn setup   total   fork setup   total (ms)\n");
+  for (int stages = 1; stages <= 64; stages *= 2)
+  {
+    double setup[2] = {0}, total[2] = {0};
+    for (int r = 0; r < rounds; r++)
+      for (int mode = LAUNCH_SPAWN; mode <= LAUNCH_FORK; mode++)
+        launcher_bench_round(stages, mode, exec_path, &setup[mode], &total[mode]);
+    printf("%6d %12.3f %7.3f %11.3f %7.3f\n", stages, setup[LAUNCH_SPAWN] / rounds,
+           total[LAUNCH_SPAWN] / rounds, setup[LAUNCH_FORK] / rounds,
+           total[LAUNCH_FORK] / rounds);
+  }
+  return SUCCESS;
+}
+
+/**
+ * launcher [spawn|fork|-b rounds]: show or select how pipeline stages are
+ * started, or compare both
+ */
+int launcher_builtin(struct command_t *command)
+{
+  if (command->arg_count > 0 && strcmp(command->args[0], "-b") == 0)
+  {
+    int rounds = command->arg_count > 1 ? atoi(command->args[1]) : 20;
+    return launcher_bench(rounds > 0 ? rounds : 20);
+  }
+  if (command->arg_count == 0)
+    printf("%s\n", launcher_mode == LAUNCH_SPAWN ? "spawn" : "fork");
+  else if (strcmp(command->args[0], "spawn") == 0)
+    launcher_mode = LAUNCH_SPAWN;
+  else if (strcmp(command->args[0], "fork") == 0)
+    launcher_mode = LAUNCH_FORK;
+  else
+    printf("-%s: %s: unknown mode %s\n", sysname, command->name, command->args[0]);
+  return SUCCESS;
+}
+
+// TODO: your implementation here
+void redirection_part2(struct command_t *command)
+{
   // Dont put spaces after redirection symbols !!!!
   if (command->redirects[0] != NULL)
   { // for <
     int in = open(command->redirects[0], O_RDONLY, 0644);
     if (in == -1)
     {
-      printf("Error opening redirect source file!\n");
+      printf("Error opening redirect source file!\n");
+    }
+    dup2(in, STDIN_FILENO); // copy file to stdin
+    close(in);
+  }
+
+  if (command->redirects[1] != NULL)
+  { // for >
+    int out = open(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1)
+    {
+      printf("Error opening redirect target file!\n");
+    }
+    dup2(out, STDOUT_FILENO); // copy file to stdout
+    close(out);
+  }
+
+  if (command->redirects[2] != NULL)
+  { // for >>
+    int out = open(command->redirects[2], O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (out == -1)
+    {
+      printf("Error opening redirect target file!\n");
+    }
+    dup2(out, STDOUT_FILENO); // copy file to stdout
+    close(out);
+  }
+}
+
+/*
+ * Job control.
+ * Each pipeline is a job with its own process group. SIGCHLD is blocked and
+ * read from a signalfd by the event loop, children are then reaped with
+ * non-blocking wait4() calls, so a background job never makes the shell
+ * block and its completion is reported right away. Waiting for a
+ * foreground job keeps running the event loop.
+ */
+static struct
+{
+  struct job **table; // indexed by job id - 1, NULL for free ids
+  int size;
+  int sigchld_fd;
+  pid_t shell_pgid;
+} jobs;
+
+static bool jobs_have_done()
+{
+  for (int i = 0; i < jobs.size; i++)
+    if (jobs.table[i] && jobs.table[i]->state == JOB_DONE)
+      return true;
+  return false;
+}
+
+static void jobs_sigchld_ready(int fd, uint32_t events, void *data)
+{
+  struct signalfd_siginfo info[16];
+  while (read(fd, info, sizeof(info)) > 0)
+    ;
+  jobs_reap();
+  if (editor.active && jobs_have_done()) // tell right away, do not wait for input
+  {
+    prompt_interrupt_begin();
+    jobs_notify();
+    prompt_interrupt_end();
+  }
+}
+
+/**
+ * Signals an interactive shell ignores and its children must not
+ */
+void job_signal_set(sigset_t *set)
+{
+  sigemptyset(set);
+  sigaddset(set, SIGINT);
+  sigaddset(set, SIGQUIT);
+  sigaddset(set, SIGTSTP);
+  sigaddset(set, SIGTTIN);
+  sigaddset(set, SIGTTOU);
+  sigaddset(set, SIGCHLD);
+  sigaddset(set, SIGPIPE);
+}
+
+/**
+ * Undo the shell's signal setup in a forked child
+ */
+void job_default_signals()
+{
+  sigset_t set;
+  job_signal_set(&set);
+  for (int sig = 1; sig < NSIG; sig++)
+    if (sigismember(&set, sig) == 1)
+      signal(sig, SIG_DFL);
+  sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+void jobs_init()
+{
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  jobs.sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+  loop_add_fd(jobs.sigchld_fd, EPOLLIN, jobs_sigchld_ready, NULL);
+
+  // a chat peer that left shows up as EPIPE, not as a fatal signal
+  signal(SIGPIPE, SIG_IGN);
+
+  jobs.shell_pgid = getpgrp();
+  shell_interactive = !shell_batch && isatty(STDIN_FILENO) &&
+                      tcgetpgrp(STDIN_FILENO) == jobs.shell_pgid;
+  if (shell_interactive)
+  {
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+  }
+}
+
+static char *job_cmdline(struct command_t *command)
+{
+  size_t len = 1;
+  for (struct command_t *c = command; c; c = c->next)
+    for (char **a = c->argv; *a; a++)
+      len += strlen(*a) + 3;
+  char *line = malloc(len + 2);
+  line[0] = 0;
+  for (struct command_t *c = command; c; c = c->next)
+  {
+    for (char **a = c->argv; *a; a++)
+    {
+      strcat(line, *a);
+      if (a[1])
+        strcat(line, " ");
+    }
+    if (c->next)
+      strcat(line, " | ");
+  }
+  if (command->background)
+    strcat(line, " &");
+  return line;
+}
+
+struct job *job_create(struct command_t *command)
+{
+  struct job *job = calloc(1, sizeof(struct job));
+  int slot = 0;
+  while (slot < jobs.size && jobs.table[slot])
+    slot++;
+  if (slot == jobs.size)
+  {
+    jobs.table = realloc(jobs.table, sizeof(struct job *) * (jobs.size + 1));
+    jobs.table[jobs.size++] = NULL;
+  }
+  jobs.table[slot] = job;
+  job->id = slot + 1;
+  job->cmdline = job_cmdline(command);
+  clock_gettime(CLOCK_MONOTONIC, &job->started);
+  return job;
+}
+
+void job_add_process(struct job *job, pid_t pid)
+{
+  if (job->pgid == 0)
+    job->pgid = pid; // the first stage leads the group
+  job->pids = realloc(job->pids, sizeof(pid_t) * (job->process_count + 1));
+  job->pids[job->process_count++] = pid;
+  job->running++;
+}
+
+void job_remove(struct job *job)
+{
+  jobs.table[job->id - 1] = NULL;
+  free(job->pids);
+  free(job->cmdline);
+  free(job);
+}
+
+static struct job *job_of_pid(pid_t pid, int *stage)
+{
+  for (int i = 0; i < jobs.size; i++)
+  {
+    struct job *job = jobs.table[i];
+    for (int k = 0; job && k < job->process_count; k++)
+      if (job->pids[k] == pid)
+      {
+        *stage = k;
+        return job;
+      }
+  }
+  return NULL;
+}
+
+/**
+ * Reap every child that changed state, never blocks
+ */
+void jobs_reap()
+{
+  pid_t pid;
+  int status, stage;
+  struct rusage usage;
+  while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+  {
+    struct job *job = job_of_pid(pid, &stage);
+    if (job == NULL)
+      continue;
+    if (WIFSTOPPED(status))
+      job->state = JOB_STOPPED;
+    else if (WIFCONTINUED(status))
+      job->state = JOB_RUNNING;
+    else
+    {
+      timeradd(&job->cpu, &usage.ru_utime, &job->cpu);
+      timeradd(&job->cpu, &usage.ru_stime, &job->cpu);
+      if (stage == job->process_count - 1)
+        job->status = status;
+      if (--job->running == 0)
+      {
+        job->state = JOB_DONE;
+        clock_gettime(CLOCK_MONOTONIC, &job->finished);
+      }
+    }
+  }
+}
+
+static double job_wall_time(struct job *job)
+{
+  struct timespec end = job->finished;
+  if (job->state != JOB_DONE)
+    clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - job->started.tv_sec) +
+         (end.tv_nsec - job->started.tv_nsec) / 1e9;
+}
+
+static void job_print(struct job *job)
+{
+  char state[32];
+  if (job->state == JOB_RUNNING)
+    strcpy(state, "Running");
+  else if (job->state == JOB_STOPPED)
+    strcpy(state, "Stopped");
+  else if (WIFSIGNALED(job->status))
+    snprintf(state, sizeof(state), "Killed (%s)", strsignal(WTERMSIG(job->status)));
+  else if (WEXITSTATUS(job->status) != 0)
+    snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(job->status));
+  else
+    strcpy(state, "Done");
+  printf("[%d] %-8d %-16s %8.2fs wall %7.2fs cpu  %s\n", job->id, job->pgid, state,
+         job_wall_time(job), job->cpu.tv_sec + job->cpu.tv_usec / 1e6, job->cmdline);
+}
+
+/**
+ * Report and forget background jobs that finished
+ */
+void jobs_notify()
+{
+  for (int i = 0; i < jobs.size; i++)
+    if (jobs.table[i] && jobs.table[i]->state == JOB_DONE)
+    {
+      job_print(jobs.table[i]);
+      job_remove(jobs.table[i]);
+    }
+}
+
+/**
+ * Run the event loop until the job is not running anymore, timers and
+ * builtin fds keep being served meanwhile
+ */
+static void job_wait(struct job *job)
+{
+  jobs_reap();
+  while (job->state == JOB_RUNNING)
+    loop_iterate(-1);
+}
+
+/**
+ * Run a job in the foreground: give it the terminal and wait for it
+ * @param resume send SIGCONT first, for stopped jobs
+ */
+void job_foreground(struct job *job, bool resume)
+{
+  if (shell_interactive)
+    tcsetpgrp(STDIN_FILENO, job->pgid);
+  if (resume)
+  {
+    job->state = JOB_RUNNING;
+    kill(-job->pgid, SIGCONT);
+  }
+  job_wait(job);
+  if (shell_interactive)
+    tcsetpgrp(STDIN_FILENO, jobs.shell_pgid);
+  if (job->state == JOB_STOPPED)
+  {
+    printf("\n");
+    job_print(job);
+    last_status = 128 + SIGTSTP;
+  }
+  else
+  {
+    last_status = WIFSIGNALED(job->status) ? 128 + WTERMSIG(job->status)
+                                           : WEXITSTATUS(job->status);
+    job_remove(job);
+  }
+}
+
+/**
+ * Find the job named by an argument like %2 or 2, the newest one if none
+ */
+static struct job *job_from_arg(struct command_t *command)
+{
+  if (command->arg_count == 0)
+  {
+    for (int i = jobs.size - 1; i >= 0; i--)
+      if (jobs.table[i])
+        return jobs.table[i];
+  }
+  else
+  {
+    const char *arg = command->args[0];
+    int id = atoi(arg[0] == '%' ? arg + 1 : arg);
+    if (id >= 1 && id <= jobs.size && jobs.table[id - 1])
+      return jobs.table[id - 1];
+  }
+  printf("-%s: %s: no such job\n", sysname, command->name);
+  return NULL;
+}
+
+/**
+ * jobs: list jobs with their state, wall clock and CPU time
+ */
+int jobs_builtin(struct command_t *command)
+{
+  jobs_reap();
+  for (int i = 0; i < jobs.size; i++)
+    if (jobs.table[i])
+      job_print(jobs.table[i]);
+  jobs_notify(); // finished jobs were just reported
+  return SUCCESS;
+}
+
+int fg_builtin(struct command_t *command)
+{
+  struct job *job = job_from_arg(command);
+  if (job)
+  {
+    printf("%s\n", job->cmdline);
+    job_foreground(job, job->state == JOB_STOPPED);
+  }
+  return SUCCESS;
+}
+
+int bg_builtin(struct command_t *command)
+{
+  struct job *job = job_from_arg(command);
+  if (job && job->state == JOB_STOPPED)
+  {
+    job->state = JOB_RUNNING;
+    kill(-job->pgid, SIGCONT);
+    printf("[%d] %s\n", job->id, job->cmdline);
+  }
+  return SUCCESS;
+}
+
+/**
+ * wait [%job]: wait for one job, or for every running job
+ */
+int wait_builtin(struct command_t *command)
+{
+  if (command->arg_count > 0)
+  {
+    struct job *job = job_from_arg(command);
+    if (job)
+      job_wait(job);
+  }
+  else
+    for (int i = 0; i < jobs.size; i++)
+      if (jobs.table[i])
+        job_wait(jobs.table[i]);
+  jobs_notify();
+  return SUCCESS;
+}
+
+/*
+ * Executable lookup cache, like bash's `hash`.
+ * Maps a command name to the absolute path found on $PATH. Misses are cached
+ * too (path == NULL) so unknown commands do not hit the filesystem again.
+ * The whole table is flushed when $PATH changes or when the mtime of one of
+ * the PATH directories that could affect an entry changes.
+ */
+struct exec_cache_entry
+{
+  char *name;
+  char *path;    // NULL for a negative entry
+  int dir_index; // PATH directory the command was found in, -1 if negative
+  unsigned long hits;
+  struct exec_cache_entry *next;
+};
+
+struct exec_cache_dir
+{
+  char *path;
+  struct timespec mtime;
+};
+
+static struct
+{
+  char *path_env; // copy of $PATH the directory list was built from
+  struct exec_cache_dir *dirs;
+  int dir_count;
+  struct exec_cache_entry *buckets[EXEC_CACHE_BUCKETS];
+  unsigned long hits, misses;
+} exec_cache;
+
+static unsigned int exec_cache_hash(const char *name)
+{
+  unsigned int h = 2166136261u; // FNV-1a
+  while (*name)
+  {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h % EXEC_CACHE_BUCKETS;
+}
+
+/**
+ * Drop every cached entry, keeps the hit/miss counters
+ */
+void exec_cache_flush()
+{
+  for (int i = 0; i < EXEC_CACHE_BUCKETS; i++)
+  {
+    struct exec_cache_entry *e = exec_cache.buckets[i];
+    while (e)
+    {
+      struct exec_cache_entry *next = e->next;
+      free(e->name);
+      free(e->path);
+      free(e);
+      e = next;
+    }
+    exec_cache.buckets[i] = NULL;
+  }
+}
+
+static void exec_cache_load_path(const char *path_env)
+{
+  for (int i = 0; i < exec_cache.dir_count; i++)
+    free(exec_cache.dirs[i].path);
+  free(exec_cache.dirs);
+  free(exec_cache.path_env);
+  exec_cache.dirs = NULL;
+  exec_cache.dir_count = 0;
+  exec_cache.path_env = strdup(path_env);
+
+  // strsep keeps empty components, they stand for the current directory
+  char *copy = strdup(path_env), *rest = copy, *dir;
+  while ((dir = strsep(&rest, ":")) != NULL)
+  {
+    struct stat st;
+    if (dir[0] == '\0')
+      dir = ".";
+    exec_cache.dirs = realloc(exec_cache.dirs,
+                              sizeof(struct exec_cache_dir) * (exec_cache.dir_count + 1));
+    struct exec_cache_dir *d = &exec_cache.dirs[exec_cache.dir_count++];
+    d->path = strdup(dir);
+    memset(&d->mtime, 0, sizeof(d->mtime));
+    if (stat(dir, &st) == 0)
+      d->mtime = st.st_mtim;
+  }
+  free(copy);
+}
+
+/**
+ * Check that $PATH and the first dir_limit PATH directories did not change
+ * since the cache was filled, flush the cache if they did
+ */
+static void exec_cache_validate(int dir_limit)
+{
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = "";
+  if (exec_cache.path_env == NULL || strcmp(exec_cache.path_env, path_env) != 0)
+  {
+    exec_cache_flush();
+    exec_cache_load_path(path_env);
+    return;
+  }
+
+  if (dir_limit > exec_cache.dir_count)
+    dir_limit = exec_cache.dir_count;
+  for (int i = 0; i < dir_limit; i++)
+  {
+    struct stat st;
+    struct timespec mtime = {0};
+    if (stat(exec_cache.dirs[i].path, &st) == 0)
+      mtime = st.st_mtim;
+    if (mtime.tv_sec != exec_cache.dirs[i].mtime.tv_sec ||
+        mtime.tv_nsec != exec_cache.dirs[i].mtime.tv_nsec)
+    {
+      exec_cache_flush();
+      exec_cache_load_path(path_env);
+      return;
+    }
+  }
+}
+
+static struct exec_cache_entry *exec_cache_find(const char *name)
+{
+  struct exec_cache_entry *e = exec_cache.buckets[exec_cache_hash(name)];
+  while (e && strcmp(e->name, name) != 0)
+    e = e->next;
+  return e;
+}
+
+/**
+ * Resolve a command name to an executable path using $PATH
+ * @param  name command name, returned as is if it contains a '/'
+ * @return      absolute path owned by the cache, NULL if not found
+ */
+char *exec_cache_lookup(const char *name)
+{
+  if (strchr(name, '/') != NULL)
+    return (char *)name;
+
+  exec_cache_validate(0); // only compares $PATH
+  struct exec_cache_entry *e = exec_cache_find(name);
+  if (e)
+  {
+    // a hit can only be shadowed by directories up to the one it lives in,
+    // a miss can be fixed by any of them
+    exec_cache_validate(e->dir_index >= 0 ? e->dir_index + 1 : exec_cache.dir_count);
+    e = exec_cache_find(name);
+  }
+  if (e)
+  {
+    e->hits++;
+    exec_cache.hits++;
+    return e->path;
+  }
+  exec_cache.misses++;
+
+  e = malloc(sizeof(struct exec_cache_entry));
+  e->name = strdup(name);
+  e->path = NULL;
+  e->dir_index = -1;
+  e->hits = 0;
+  for (int i = 0; i < exec_cache.dir_count; i++)
+  {
+    const char *dir = exec_cache.dirs[i].path;
+    char *candidate = malloc(strlen(dir) + strlen(name) + 2);
+    struct stat st;
+    sprintf(candidate, "%s/%s", dir, name);
+    if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) &&
+        access(candidate, X_OK) == 0)
+    {
+      e->path = candidate;
+      e->dir_index = i;
+      break;
+    }
+    free(candidate);
+  }
+
+  unsigned int b = exec_cache_hash(name);
+  e->next = exec_cache.buckets[b];
+  exec_cache.buckets[b] = e;
+  return e->path;
+}
+
+/**
+ * hash [-r]: list the cached commands with their hit counts, -r empties it
+ */
+int hash_builtin(struct command_t *command)
+{
+  if (command->arg_count > 0 && strcmp(command->args[0], "-r") == 0)
+  {
+    exec_cache_flush();
+    return SUCCESS;
+  }
+
+  printf("hits\tcommand\n");
+  for (int i = 0; i < EXEC_CACHE_BUCKETS; i++)
+    for (struct exec_cache_entry *e = exec_cache.buckets[i]; e; e = e->next)
+      printf("%4lu\t%s\n", e->hits, e->path ? e->path : e->name);
+  printf("cache hits: %lu, misses: %lu\n", exec_cache.hits, exec_cache.misses);
+  return SUCCESS;
+}
+
+/**
+ * which name...: print the path each command resolves to
+ */
+int which_builtin(struct command_t *command)
+{
+  for (int i = 0; i < command->arg_count; i++)
+  {
+    char *path = exec_cache_lookup(command->args[i]);
+    if (path)
+      printf("%s\n", path);
+    else
+      printf("%s not found\n", command->args[i]);
+  }
+  printf("cache hits: %lu, misses: %lu\n", exec_cache.hits, exec_cache.misses);
+  return SUCCESS;
+}
+
+/*
+ * Tab completion.
+ * Command names come from a sorted array of every executable on $PATH plus
+ * the builtins, searched with a binary search for the prefix range. Each
+ * name remembers which PATH directories provide it as a bit mask, so
+ * inotify create/delete events on those directories update the array in
+ * place instead of rescanning. Filename completion keeps the sorted
+ * listings of the last few directories, also kept fresh with inotify.
+ */
+struct name_entry
+{
+  char *name;
+  unsigned long long dirs; // PATH directories providing a command
+  bool is_dir;             // for directory listings
+};
+
+struct name_list
+{
+  struct name_entry *v;
+  size_t count, cap;
+};
+
+struct listing_cache
+{
+  char *path;
+  int wd;
+  unsigned long last_used;
+  struct name_list names;
+};
+
+static struct
+{
+  int inotify_fd;
+  bool loaded;
+  char *path_env;   // $PATH the command list was built from
+  char **path_dirs; // PATH directories, "." for empty components
+  int *path_wds;    // watch descriptor per PATH directory, -1 while missing
+  int path_count;
+  struct name_list commands;
+  struct listing_cache dirs[COMPLETE_MAX_DIRS];
+  unsigned long clock;
+} completion = {-1};
+
+#define BUILTIN_DIR_BIT (1ULL << 63)
+
+/**
+ * Binary search for the first entry not smaller than name
+ */
+static size_t name_list_lower_bound(struct name_list *l, const char *name)
+{
+  size_t lo = 0, hi = l->count;
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (strcmp(l->v[mid].name, name) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static struct name_entry *name_list_insert(struct name_list *l, const char *name)
+{
+  size_t i = name_list_lower_bound(l, name);
+  if (i < l->count && strcmp(l->v[i].name, name) == 0)
+    return &l->v[i];
+  if (l->count == l->cap)
+  {
+    l->cap = l->cap ? l->cap * 2 : 256;
+    l->v = realloc(l->v, sizeof(struct name_entry) * l->cap);
+  }
+  memmove(&l->v[i + 1], &l->v[i], sizeof(struct name_entry) * (l->count - i));
+  l->count++;
+  l->v[i].name = strdup(name);
+  l->v[i].dirs = 0;
+  l->v[i].is_dir = false;
+  return &l->v[i];
+}
+
+static void name_list_remove_at(struct name_list *l, size_t i)
+{
+  free(l->v[i].name);
+  memmove(&l->v[i], &l->v[i + 1], sizeof(struct name_entry) * (l->count - i - 1));
+  l->count--;
+}
+
+static void name_list_clear(struct name_list *l)
+{
+  for (size_t i = 0; i < l->count; i++)
+    free(l->v[i].name);
+  free(l->v);
+  memset(l, 0, sizeof(struct name_list));
+}
+
+static int name_entry_cmp(const void *a, const void *b)
+{
+  return strcmp(((const struct name_entry *)a)->name,
+                ((const struct name_entry *)b)->name);
+}
+
+static bool is_executable_in(const char *dir, const char *name)
+{
+  char path[4096];
+  struct stat st;
+  if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path))
+    return false;
+  return stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0;
+}
+
+#define PATH_WATCH_MASK                                                        \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB |           \
+   IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+/**
+ * Add the executables of the i-th PATH directory to the command list,
+ * used when a directory missing or removed earlier (re)appears
+ */
+static void complete_scan_dir(int i)
+{
+  const char *dir = completion.path_dirs[i];
+  completion.path_wds[i] = inotify_add_watch(completion.inotify_fd, dir, PATH_WATCH_MASK);
+  if (completion.path_wds[i] < 0)
+    return;
+  DIR *d = opendir(dir);
+  if (d == NULL)
+    return;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL)
+    if (de->d_name[0] != '.' && is_executable_in(dir, de->d_name))
+      name_list_insert(&completion.commands, de->d_name)->dirs |= 1ULL << i;
+  closedir(d);
+}
+
+/**
+ * Forget the i-th PATH directory after it was removed or renamed, its
+ * commands lose their bit and the watch is retried on the next completion
+ */
+static void complete_lose_dir(int i)
+{
+  completion.path_wds[i] = -1;
+  for (size_t at = completion.commands.count; at-- > 0;)
+    if (completion.commands.v[at].dirs & (1ULL << i) &&
+        (completion.commands.v[at].dirs &= ~(1ULL << i)) == 0)
+      name_list_remove_at(&completion.commands, at);
+}
+
+/**
+ * (Re)build the command list from $PATH, bulk loaded then sorted once
+ */
+static void complete_load_commands(const char *path_env)
+{
+  for (int i = 0; i < completion.path_count; i++)
+  {
+    if (completion.path_wds[i] >= 0)
+      inotify_rm_watch(completion.inotify_fd, completion.path_wds[i]);
+    free(completion.path_dirs[i]);
+  }
+  free(completion.path_dirs);
+  free(completion.path_wds);
+  free(completion.path_env);
+  name_list_clear(&completion.commands);
+  completion.path_dirs = NULL;
+  completion.path_wds = NULL;
+  completion.path_count = 0;
+  completion.path_env = strdup(path_env);
+
+  // split like exec_cache_load_path so indexes match the bits
+  struct name_list raw = {0};
+  char *copy = strdup(path_env), *rest = copy, *dir;
+  while ((dir = strsep(&rest, ":")) != NULL)
+  {
+    if (*dir == '\0')
+      dir = "."; // an empty component is the current directory
+    int bit = completion.path_count;
+    completion.path_dirs = realloc(completion.path_dirs, sizeof(char *) * (bit + 1));
+    completion.path_wds = realloc(completion.path_wds, sizeof(int) * (bit + 1));
+    completion.path_dirs[bit] = strdup(dir);
+    completion.path_wds[bit] = -1;
+    completion.path_count++;
+    if (bit >= 63)
+      continue; // no bit left to track it
+    completion.path_wds[bit] = inotify_add_watch(completion.inotify_fd, dir, PATH_WATCH_MASK);
+    DIR *d = opendir(dir);
+    if (d == NULL)
+      continue;
+    struct dirent *de;
+    while ((de = readdir(d)) != NULL)
+    {
+      if (de->d_name[0] == '.' || (de->d_type != DT_REG && de->d_type != DT_LNK &&
+                                   de->d_type != DT_UNKNOWN))
+        continue;
+      if (!is_executable_in(dir, de->d_name))
+        continue;
+      if (raw.count == raw.cap)
+      {
+        raw.cap = raw.cap ? raw.cap * 2 : 1024;
+        raw.v = realloc(raw.v, sizeof(struct name_entry) * raw.cap);
+      }
+      raw.v[raw.count].name = strdup(de->d_name);
+      raw.v[raw.count].is_dir = false;
+      raw.v[raw.count++].dirs = 1ULL << bit;
+    }
+    closedir(d);
+  }
+  free(copy);
+  for (size_t i = 0; i < BUILTIN_COUNT; i++)
+  {
+    if (raw.count == raw.cap)
+    {
+      raw.cap = raw.cap ? raw.cap * 2 : 1024;
+      raw.v = realloc(raw.v, sizeof(struct name_entry) * raw.cap);
+    }
+    raw.v[raw.count].name = strdup(builtins[i].name);
+    raw.v[raw.count].is_dir = false;
+    raw.v[raw.count++].dirs = BUILTIN_DIR_BIT;
+  }
+
+  // sort once and merge duplicates found in several directories
+  qsort(raw.v, raw.count, sizeof(struct name_entry), name_entry_cmp);
+  size_t out = 0;
+  for (size_t i = 0; i < raw.count; i++)
+  {
+    if (out > 0 && strcmp(raw.v[out - 1].name, raw.v[i].name) == 0)
+    {
+      raw.v[out - 1].dirs |= raw.v[i].dirs;
+      free(raw.v[i].name);
+      continue;
+    }
+    raw.v[out++] = raw.v[i];
+  }
+  raw.count = out;
+  completion.commands = raw;
+}
+
+static void complete_drop_listing(struct listing_cache *c)
+{
+  if (c->path == NULL)
+    return;
+  if (c->wd >= 0)
+    inotify_rm_watch(completion.inotify_fd, c->wd);
+  free(c->path);
+  name_list_clear(&c->names);
+  memset(c, 0, sizeof(struct listing_cache));
+}
+
+/**
+ * Apply pending inotify events to the cached names
+ */
+static void complete_apply_events()
+{
+  char events[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(completion.inotify_fd, events, sizeof(events))) > 0)
+  {
+    for (char *p = events; p < events + n;)
+    {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) // lost events, start over lazily
+      {
+        completion.loaded = false;
+        for (int i = 0; i < COMPLETE_MAX_DIRS; i++)
+          complete_drop_listing(&completion.dirs[i]);
+        continue;
+      }
+      bool added = ev->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+      bool removed = ev->mask & (IN_DELETE | IN_MOVED_FROM);
+
+      for (int i = 0; i < completion.path_count && i < 63; i++)
+      {
+        if (completion.path_wds[i] != ev->wd)
+          continue;
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+        {
+          if (!(ev->mask & IN_IGNORED))
+            inotify_rm_watch(completion.inotify_fd, ev->wd);
+          complete_lose_dir(i);
+          continue;
+        }
+        if (ev->len == 0)
+          continue;
+        if (added && is_executable_in(completion.path_dirs[i], ev->name))
+          name_list_insert(&completion.commands, ev->name)->dirs |= 1ULL << i;
+        else if (added || removed)
+        {
+          size_t at = name_list_lower_bound(&completion.commands, ev->name);
+          if (at < completion.commands.count &&
+              strcmp(completion.commands.v[at].name, ev->name) == 0 &&
+              (completion.commands.v[at].dirs &= ~(1ULL << i)) == 0)
+            name_list_remove_at(&completion.commands, at);
+        }
+      }
+
+      for (int i = 0; i < COMPLETE_MAX_DIRS; i++)
+      {
+        struct listing_cache *c = &completion.dirs[i];
+        if (c->path == NULL || c->wd != ev->wd)
+          continue;
+        if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+          complete_drop_listing(c);
+        else if (ev->len > 0 && (ev->mask & (IN_CREATE | IN_MOVED_TO)))
+          name_list_insert(&c->names, ev->name)->is_dir = ev->mask & IN_ISDIR;
+        else if (ev->len > 0 && removed)
+        {
+          size_t at = name_list_lower_bound(&c->names, ev->name);
+          if (at < c->names.count && strcmp(c->names.v[at].name, ev->name) == 0)
+            name_list_remove_at(&c->names, at);
+        }
+      }
+    }
+  }
+}
+
+/**
+ * Get the cached sorted listing of a directory, read it on a miss
+ */
+static struct name_list *complete_listing(const char *path)
+{
+  struct listing_cache *slot = &completion.dirs[0];
+  completion.clock++;
+  for (int i = 0; i < COMPLETE_MAX_DIRS; i++)
+  {
+    struct listing_cache *c = &completion.dirs[i];
+    if (c->path && strcmp(c->path, path) == 0)
+    {
+      c->last_used = completion.clock;
+      return &c->names;
+    }
+    if (c->path == NULL || (slot->path && c->last_used < slot->last_used))
+      slot = c; // free slot, or the least recently used one
+  }
+
+  DIR *d = opendir(path);
+  if (d == NULL)
+    return NULL;
+  complete_drop_listing(slot);
+  slot->path = strdup(path);
+  slot->last_used = completion.clock;
+  slot->wd = inotify_add_watch(completion.inotify_fd, path,
+                               IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                   IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |
+                                   IN_ONLYDIR);
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL)
+  {
+    if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+      continue;
+    struct name_list *l = &slot->names;
+    if (l->count == l->cap)
+    {
+      l->cap = l->cap ? l->cap * 2 : 64;
+      l->v = realloc(l->v, sizeof(struct name_entry) * l->cap);
+    }
+    bool is_dir = de->d_type == DT_DIR;
+    if (de->d_type == DT_UNKNOWN || de->d_type == DT_LNK)
+    {
+      struct stat st;
+      char full[4096];
+      is_dir = snprintf(full, sizeof(full), "%s/%s", path, de->d_name) < (int)sizeof(full) &&
+               stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+    }
+    l->v[l->count].name = strdup(de->d_name);
+    l->v[l->count].dirs = 0;
+    l->v[l->count++].is_dir = is_dir;
+  }
+  closedir(d);
+  qsort(slot->names.v, slot->names.count, sizeof(struct name_entry), name_entry_cmp);
+  return &slot->names;
+}
+
+/**
+ * Complete the word before the cursor
+ * The word is extended to the longest common prefix of the candidates,
+ * a unique match also gets a trailing space (or '/' for directories).
+ * @param  buf      line buffer
+ * @param  index    length of the line, updated
+ * @param  buf_size size of buf
+ * @param  list     print the candidates if nothing could be added
+ * @return          true if the line needs to be redrawn
+ */
+bool complete_line(char *buf, int *index, int buf_size, bool list)
+{
+  if (completion.inotify_fd == -1)
+    completion.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  complete_apply_events();
+  const char *path_env = getenv("PATH");
+  if (path_env == NULL)
+    path_env = "";
+  if (!completion.loaded || strcmp(completion.path_env, path_env) != 0)
+  {
+    complete_load_commands(path_env);
+    completion.loaded = true;
+  }
+  for (int i = 0; i < completion.path_count && i < 63; i++)
+    if (completion.path_wds[i] < 0) // missing or removed, it may be back
+      complete_scan_dir(i);
+
+  int start = *index;
+  while (start > 0 && strchr(" \t|<>&", buf[start - 1]) == NULL)
+    start--;
+  int before = start;
+  while (before > 0 && (buf[before - 1] == ' ' || buf[before - 1] == '\t'))
+    before--;
+  char word[4096];
+  int word_len = *index - start;
+  memcpy(word, buf + start, word_len);
+  word[word_len] = 0;
+  bool command_pos = (before == 0 || buf[before - 1] == '|' || buf[before - 1] == '&') &&
+                     strchr(word, '/') == NULL;
+
+  struct name_list *names;
+  const char *prefix = word;
+  if (command_pos)
+    names = &completion.commands;
+  else
+  {
+    char dir[4096];
+    char *slash = strrchr(word, '/');
+    if (slash == NULL)
+      getcwd(dir, sizeof(dir));
+    else if (word[0] == '/')
+      snprintf(dir, sizeof(dir), "%.*s", (int)(slash - word) + 1, word);
+    else
+    {
+      char cwd[2048];
+      getcwd(cwd, sizeof(cwd));
+      snprintf(dir, sizeof(dir), "%s/%.*s", cwd, (int)(slash - word), word);
+    }
+    prefix = slash ? slash + 1 : word;
+    names = complete_listing(dir);
+    if (names == NULL)
+      return false;
+  }
+
+  size_t plen = strlen(prefix);
+  size_t first = name_list_lower_bound(names, prefix), last = first;
+  while (last < names->count && strncmp(names->v[last].name, prefix, plen) == 0)
+    last++;
+  if (prefix[0] != '.' && !command_pos) // hide dot files unless asked for
+    while (first < last && names->v[first].name[0] == '.')
+      first++;
+  if (first == last)
+    return false;
+
+  // longest common prefix of the sorted range is the one of its ends
+  const char *a = names->v[first].name, *b = names->v[last - 1].name;
+  size_t common = plen;
+  while (a[common] && a[common] == b[common])
+    common++;
+  int added = 0;
+  if (common > plen && *index + (int)(common - plen) < buf_size - 2)
+  {
+    memcpy(buf + *index, a + plen, common - plen);
+    *index += common - plen;
+    added = common - plen;
+  }
+  if (last - first == 1 && *index < buf_size - 2)
+  {
+    buf[(*index)++] = names->v[first].is_dir ? '/' : ' ';
+    return true;
+  }
+  if (added > 0 || !list)
+    return added > 0;
+
+  printf("\n");
+  for (size_t i = first; i < last && i < first + COMPLETE_MAX_SHOWN; i++)
+    printf("%s%s  ", names->v[i].name, names->v[i].is_dir ? "/" : "");
+  if (last - first > COMPLETE_MAX_SHOWN)
+    printf("... (%zu more)", last - first - COMPLETE_MAX_SHOWN);
+  printf("\n");
+  return true;
+}
+
+/**
+ * complete [-b rounds] line: print what Tab makes of line, or time the
+ * completion of line, rebuilding the command list (cold) and from the
+ * cached lists (warm)
+ */
+int complete_builtin(struct command_t *command)
+{
+  int rounds = 0, first = 0;
+  if (command->arg_count > 0 && strcmp(command->args[0], "-b") == 0)
+  {
+    rounds = command->arg_count > 1 ? atoi(command->args[1]) : 0;
+    rounds = rounds > 0 ? rounds : 1000;
+    first = command->arg_count > 1 ? 2 : 1;
+  }
+  char line[4096] = "";
+  int len = 0;
+  for (int i = first; i < command->arg_count; i++)
+    len += snprintf(line + len, sizeof(line) - len, "%s%s", i > first ? " " : "",
+                    command->args[i]);
+  if (len >= (int)sizeof(line))
+  {
+    printf("-%s: %s: line too long\n", sysname, command->name);
+    return UNKNOWN;
+  }
+
+  if (rounds == 0)
+  {
+    complete_line(line, &len, sizeof(line), true);
+    line[len] = '\0';
+    printf("%s\n", line);
+    return SUCCESS;
+  }
+
+  struct timespec begin, end;
+  double cold = 0, warm = 0;
+  int cold_rounds = rounds < 10 ? rounds : 10; // a PATH scan is slow
+  char buf[4096];
+  int index;
+  for (int r = 0; r < cold_rounds + rounds; r++)
+  {
+    completion.loaded = r >= cold_rounds;
+    memcpy(buf, line, len + 1);
+    index = len;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    complete_line(buf, &index, sizeof(buf), false);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double us = (end.tv_sec - begin.tv_sec) * 1e6 + (end.tv_nsec - begin.tv_nsec) / 1e3;
+    if (r < cold_rounds)
+      cold += us;
+    else
+      warm += us;
+  }
+  printf("%zu commands, cold %.1f us, warm %.2f us per completion\n",
+         completion.commands.count, cold / cold_rounds, warm / rounds);
+  return SUCCESS;
+}
+
+/*
+ * Batched output for streaming builtins, avoids one write per line
+ */
+struct out_buf
+{
+  int fd;
+  size_t len;
+  char data[OUT_BUF_SIZE];
+};
+
+int out_flush(struct out_buf *out)
+{
+  size_t done = 0;
+  while (done < out->len)
+  {
+    ssize_t w = write(out->fd, out->data + done, out->len - done);
+    if (w == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    done += w;
+  }
+  out->len = 0;
+  return 0;
+}
+
+int out_write(struct out_buf *out, const char *data, size_t len)
+{
+  if (out->len + len > OUT_BUF_SIZE)
+  {
+    if (out_flush(out) == -1)
+      return -1;
+    while (len > OUT_BUF_SIZE) // too big to batch, write through
+    {
+      ssize_t w = write(out->fd, data, len);
+      if (w == -1)
+      {
+        if (errno == EINTR)
+          continue;
+        return -1;
+      }
+      data += w;
+      len -= w;
+    }
+  }
+  memcpy(out->data + out->len, data, len);
+  out->len += len;
+  return 0;
+}
+
+/*
+ * Growable byte string used to keep a line across block boundaries
+ */
+struct line_buf
+{
+  char *data;
+  size_t len, cap;
+};
+
+void line_buf_set(struct line_buf *l, const char *data, size_t len)
+{
+  if (len > l->cap)
+  {
+    l->cap = len * 2;
+    l->data = realloc(l->data, l->cap);
+  }
+  memcpy(l->data, data, len);
+  l->len = len;
+}
+
+void line_buf_append(struct line_buf *l, const char *data, size_t len)
+{
+  if (l->len + len > l->cap)
+  {
+    l->cap = (l->len + len) * 2;
+    l->data = realloc(l->data, l->cap);
+  }
+  memcpy(l->data + l->len, data, len);
+  l->len += len;
+}
+
+/*
+ * Batch mode: shellax -c commands, shellax script, or commands piped to
+ * stdin. Lines are cut out of large reads and run without a prompt,
+ * termios calls or history. When the script is the shell's stdin, the
+ * commands share it: a seekable one is put back right after the running
+ * line, a pipe is read a byte at a time like sh does, so the commands see
+ * the input following their line. Background jobs run on and are waited
+ * for at the end of the script, then pomodoro sessions and psvis --watch
+ * until they finish. chatroom needs the prompt and is refused, sched only
+ * edits the schedule and leaves running it to the interactive shells.
+ */
+
+/**
+ * Run one script line in place
+ * @return false when the script has to stop
+ */
+static bool batch_line(char *line)
+{
+  while (*line == ' ' || *line == '\t')
+    line++;
+  if (*line == '\0' || *line == '#') // also skips the #! line
+    return true;
+  struct command_t *command = calloc(1, sizeof(struct command_t));
+  parse_command(line, command);
+  batch_commands++;
+  if (batch_parse_only)
+  {
+    free_command(command);
+    return true;
+  }
+  int code = process_command(command);
+  free_command(command);
+  return code != EXIT;
+}
+
+/**
+ * Run the lines of a string, a line at a time
+ */
+void batch_run_string(const char *commands)
+{
+  char *copy = strdup(commands), *line = copy, *nl;
+  bool running = true;
+  while (running && (nl = strchr(line, '\n')) != NULL)
+  {
+    *nl = '\0';
+    running = batch_line(line);
+    line = nl + 1;
+  }
+  if (running)
+    batch_line(line);
+  free(copy);
+}
+
+/**
+ * Run every line read from fd, in IO_BLOCK_SIZE reads unless the commands
+ * share fd as their stdin
+ */
+void batch_run_fd(int fd)
+{
+  bool shared = fd == STDIN_FILENO && !batch_parse_only;
+  off_t offset = shared ? lseek(fd, 0, SEEK_CUR) : -1; // of block[0], -1 if unseekable
+  size_t block_size = shared && offset == -1 ? 1 : IO_BLOCK_SIZE;
+  char *block = malloc(block_size);
+  struct line_buf partial = {0}; // line cut by the end of a block
+  bool running = true;
+  ssize_t n;
+  while (running && (n = read(fd, block, block_size)) != 0)
+  {
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      printf("-%s: read: %s\n", sysname, strerror(errno));
+      break;
+    }
+    char *p = block, *end = block + n, *nl;
+    bool moved = false; // a command read from fd, go on where it stopped
+    while (running && !moved && (nl = memchr(p, '\n', end - p)) != NULL)
+    {
+      *nl = '\0';
+      off_t next = offset + (nl + 1 - block);
+      if (shared && offset != -1)
+        lseek(fd, next, SEEK_SET);
+      if (partial.len > 0)
+      {
+        line_buf_append(&partial, p, nl - p + 1);
+        running = batch_line(partial.data);
+        partial.len = 0;
+      }
+      else
+        running = batch_line(p);
+      p = nl + 1;
+      moved = shared && offset != -1 && lseek(fd, 0, SEEK_CUR) != next;
+    }
+    if (!shared || offset == -1)
+      line_buf_append(&partial, p, end - p);
+    else if (moved)
+      offset = lseek(fd, 0, SEEK_CUR);
+    else if (p > block) // read the cut line again with the next block
+      offset = lseek(fd, offset + (p - block), SEEK_SET);
+    else // no newline in a whole block
+    {
+      line_buf_append(&partial, p, end - p);
+      offset += n;
+    }
+  }
+  if (running && partial.len > 0)
+  {
+    line_buf_append(&partial, "", 1);
+    batch_line(partial.data);
+  }
+  free(partial.data);
+  free(block);
+}
+
+/**
+ * At the end of a script, wait for the jobs it left in the background
+ */
+void batch_wait_jobs()
+{
+  int status = last_status;
+  for (int i = 0; i < jobs.size; i++)
+    if (jobs.table[i])
+    {
+      job_wait(jobs.table[i]);
+      job_remove(jobs.table[i]);
+    }
+  last_status = status; // the script's status is its last command's
+}
+
+struct uniq_state
+{
+  bool count, only_dups, only_unique;
+  bool have_prev;
+  unsigned long prev_count;
+  struct line_buf prev;
+  struct out_buf *out;
+};
+
+static void uniq_emit(struct uniq_state *st)
+{
+  if (!st->have_prev)
+    return;
+  if (st->only_dups && st->prev_count < 2)
+    return;
+  if (st->only_unique && st->prev_count > 1)
+    return;
+  if (st->count)
+  {
+    char num[32];
+    int n = sprintf(num, "%lu ", st->prev_count);
+    out_write(st->out, num, n);
+  }
+  out_write(st->out, st->prev.data, st->prev.len);
+  out_write(st->out, "\n", 1);
+}
+
+static void uniq_line(struct uniq_state *st, const char *line, size_t len)
+{
+  if (st->have_prev && st->prev.len == len && memcmp(st->prev.data, line, len) == 0)
+  {
+    st->prev_count++; // duplicates never need a copy
+    return;
+  }
+  uniq_emit(st);
+  line_buf_set(&st->prev, line, len);
+  st->prev_count = 1;
+  st->have_prev = true;
+}
+
+/**
+ * myuniq [-c|--count] [-d] [-u] [file]: collapse adjacent duplicate lines
+ * Streams the input in large blocks, only the previous line is kept, so
+ * memory stays constant apart from the longest line.
+ * @param  command command with the options
+ * @return         exit status
+ */
+int myuniq(struct command_t *command)
+{
+  struct uniq_state st = {0};
+  const char *file = NULL;
+  bool timing = false;
+  for (int i = 0; i < command->arg_count; i++)
+  {
+    const char *a = command->args[i];
+    if (strcmp(a, "-t") == 0)
+      timing = true;
+    else if (strcmp(a, "-c") == 0 || strcmp(a, "--count") == 0)
+      st.count = true;
+    else if (strcmp(a, "-d") == 0 || strcmp(a, "--repeated") == 0)
+      st.only_dups = true;
+    else if (strcmp(a, "-u") == 0 || strcmp(a, "--unique") == 0)
+      st.only_unique = true;
+    else if (a[0] == '-' && a[1] != 0)
+    {
+      fprintf(stderr, "myuniq: unknown option %s\n", a);
+      return 2;
+    }
+    else
+      file = a;
+  }
+
+  int fd = STDIN_FILENO;
+  if (file != NULL && (fd = open(file, O_RDONLY)) == -1)
+  {
+    fprintf(stderr, "myuniq: %s: %s\n", file, strerror(errno));
+    return 1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  st.out = malloc(sizeof(struct out_buf));
+  st.out->fd = STDOUT_FILENO;
+  st.out->len = 0;
+  char *block = malloc(IO_BLOCK_SIZE);
+  struct line_buf partial = {0}; // line cut by the end of a block
+  unsigned long long bytes = 0;
+  struct timespec begin, end_time;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  ssize_t n;
+  while ((n = read(fd, block, IO_BLOCK_SIZE)) != 0)
+  {
+    if (n == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "myuniq: %s\n", strerror(errno));
+      break;
+    }
+    bytes += n;
+    const char *p = block, *end = block + n;
+    const char *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+      if (partial.len > 0)
+      {
+        line_buf_append(&partial, p, nl - p);
+        uniq_line(&st, partial.data, partial.len);
+        partial.len = 0;
+      }
+      else
+        uniq_line(&st, p, nl - p);
+      p = nl + 1;
+    }
+    if (p < end)
+      line_buf_append(&partial, p, end - p);
+  }
+  if (partial.len > 0) // last line without a newline
+    uniq_line(&st, partial.data, partial.len);
+  uniq_emit(&st);
+  out_flush(st.out);
+  if (timing) // throughput, e.g. myuniq -t big.log > /dev/null
+  {
+    clock_gettime(CLOCK_MONOTONIC, &end_time);
+    double seconds = (end_time.tv_sec - begin.tv_sec) + (end_time.tv_nsec - begin.tv_nsec) / 1e9;
+    fprintf(stderr, "myuniq: %llu bytes in %.3f s, %.1f MB/s\n", bytes, seconds,
+            bytes / seconds / 1e6);
+  }
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+  free(block);
+  free(partial.data);
+  free(st.prev.data);
+  free(st.out);
+  return 0;
+}
+
+/*
+ * mysort: external merge sort.
+ * Lines are collected in a chunk of at most mem_cap bytes, the chunk is
+ * split between threads that qsort their part, then the parts are merged
+ * with a heap either straight to the output (input fit in memory) or into
+ * a run file. The line array counts against mem_cap too. Runs are k-way
+ * merged with the same heap, at most SORT_MERGE_FANIN at once: whenever
+ * that many runs of one level exist they become a run of the next level.
+ * With -u equal lines are dropped while merging.
+ */
+struct sort_line
+{
+  const char *data;
+  size_t len;
+};
+
+struct merge_src
+{
+  struct sort_line cur;
+  struct sort_line *next, *end; // in-memory part
+  FILE *fp;                     // or spilled run
+  char *buf;
+  size_t cap;
+};
+
+struct sort_part
+{
+  struct sort_line *lines;
+  size_t count;
+};
+
+struct sort_run
+{
+  FILE *fp;
+  int level; // merged from SORT_MERGE_FANIN runs of the level below
+};
+
+static int sort_line_cmp(const struct sort_line *a, const struct sort_line *b)
+{
+  size_t n = a->len < b->len ? a->len : b->len;
+  int r = memcmp(a->data, b->data, n);
+  if (r != 0)
+    return r;
+  return a->len < b->len ? -1 : a->len > b->len;
+}
+
+static int sort_line_qcmp(const void *a, const void *b)
+{
+  return sort_line_cmp(a, b);
+}
+
+static void *sort_part_thread(void *arg)
+{
+  struct sort_part *part = arg;
+  qsort(part->lines, part->count, sizeof(struct sort_line), sort_line_qcmp);
+  return NULL;
+}
+
+static bool merge_src_advance(struct merge_src *src)
+{
+  if (src->fp == NULL)
+  {
+    if (src->next == src->end)
+      return false;
+    src->cur = *src->next++;
+    return true;
+  }
+  ssize_t n = getline(&src->buf, &src->cap, src->fp);
+  if (n <= 0)
+    return false;
+  src->cur.data = src->buf;
+  src->cur.len = n - 1; // runs always end lines with a newline
+  return true;
+}
+
+static void heap_sift_down(struct merge_src **heap, int size, int i)
+{
+  while (1)
+  {
+    int min = i, l = 2 * i + 1, r = 2 * i + 2;
+    if (l < size && sort_line_cmp(&heap[l]->cur, &heap[min]->cur) < 0)
+      min = l;
+    if (r < size && sort_line_cmp(&heap[r]->cur, &heap[min]->cur) < 0)
+      min = r;
+    if (min == i)
+      return;
+    struct merge_src *t = heap[i];
+    heap[i] = heap[min];
+    heap[min] = t;
+    i = min;
+  }
+}
+
+/**
+ * k-way merge of sorted sources into out
+ * @param unique drop lines equal to the previously written one
+ */
+static void merge_sources(struct merge_src *srcs, int count, struct out_buf *out,
+                          bool unique)
+{
+  struct merge_src **heap = malloc(sizeof(struct merge_src *) * (count + 1));
+  int size = 0;
+  for (int i = 0; i < count; i++)
+    if (merge_src_advance(&srcs[i]))
+      heap[size++] = &srcs[i];
+  for (int i = size / 2 - 1; i >= 0; i--)
+    heap_sift_down(heap, size, i);
+
+  struct line_buf last = {0};
+  bool have_last = false;
+  while (size > 0)
+  {
+    struct merge_src *top = heap[0];
+    if (!unique || !have_last || last.len != top->cur.len ||
+        memcmp(last.data, top->cur.data, last.len) != 0)
+    {
+      out_write(out, top->cur.data, top->cur.len);
+      out_write(out, "\n", 1);
+      if (unique)
+      {
+        line_buf_set(&last, top->cur.data, top->cur.len);
+        have_last = true;
+      }
+    }
+    if (!merge_src_advance(top))
+      heap[0] = heap[--size];
+    heap_sift_down(heap, size, 0);
+  }
+  free(last.data);
+  free(heap);
+}
+
+/**
+ * Sort the lines of a chunk with up to threads workers and merge the
+ * sorted parts into out
+ */
+static void sort_chunk(struct sort_line *lines, size_t count, int threads,
+                       struct out_buf *out, bool unique)
+{
+  if ((size_t)threads > count / 1024 + 1) // not worth a thread per few lines
+    threads = count / 1024 + 1;
+  pthread_t tids[SORT_MAX_THREADS];
+  struct sort_part parts[SORT_MAX_THREADS];
+  struct merge_src srcs[SORT_MAX_THREADS];
+  size_t per = count / threads;
+  for (int t = 0; t < threads; t++)
+  {
+    parts[t].lines = lines + t * per;
+    parts[t].count = t == threads - 1 ? count - t * per : per;
+    if (t == 0 || pthread_create(&tids[t], NULL, sort_part_thread, &parts[t]) != 0)
+    {
+      sort_part_thread(&parts[t]);
+      tids[t] = 0;
+    }
+  }
+  for (int t = 0; t < threads; t++)
+  {
+    if (tids[t])
+      pthread_join(tids[t], NULL);
+    memset(&srcs[t], 0, sizeof(struct merge_src));
+    srcs[t].next = parts[t].lines;
+    srcs[t].end = parts[t].lines + parts[t].count;
+  }
+  merge_sources(srcs, threads, out, unique);
+}
+
+/**
+ * Sort a chunk into a new run file
+ * @return the run, rewound, NULL on error
+ */
+static FILE *sort_spill(struct sort_line *lines, size_t count, int threads, bool unique)
+{
+  FILE *run = tmpfile();
+  if (run == NULL)
+    return NULL;
+  struct out_buf *run_out = malloc(sizeof(struct out_buf));
+  run_out->fd = fileno(run);
+  run_out->len = 0;
+  sort_chunk(lines, count, threads, run_out, unique);
+  int r = out_flush(run_out);
+  free(run_out);
+  if (r == -1)
+  {
+    fclose(run);
+    return NULL;
+  }
+  rewind(run);
+  return run;
+}
+
+/**
+ * Merge runs into out and close them
+ * @return 0, -1 on a write error
+ */
+static int sort_merge_runs(struct sort_run *runs, int count, struct out_buf *out, bool unique)
+{
+  struct merge_src *srcs = calloc(count, sizeof(struct merge_src));
+  for (int i = 0; i < count; i++)
+    srcs[i].fp = runs[i].fp;
+  merge_sources(srcs, count, out, unique);
+  for (int i = 0; i < count; i++)
+  {
+    free(srcs[i].buf);
+    fclose(runs[i].fp);
+  }
+  free(srcs);
+  return out_flush(out);
+}
+
+/**
+ * Merge the last count runs into one run of the given level
+ * @return 0, -1 on error, the runs are closed either way
+ */
+static int sort_merge_tail(struct sort_run *runs, int *run_count, int count, int level,
+                           bool unique)
+{
+  struct sort_run *tail = runs + *run_count - count;
+  *run_count -= count;
+  FILE *merged = tmpfile();
+  if (merged == NULL)
+  {
+    for (int i = 0; i < count; i++)
+      fclose(tail[i].fp);
+    return -1;
+  }
+  struct out_buf *run_out = malloc(sizeof(struct out_buf));
+  run_out->fd = fileno(merged);
+  run_out->len = 0;
+  int r = sort_merge_runs(tail, count, run_out, unique);
+  free(run_out);
+  if (r == -1)
+  {
+    fclose(merged);
+    return -1;
+  }
+  rewind(merged);
+  runs[*run_count].fp = merged;
+  runs[(*run_count)++].level = level;
+  return 0;
+}
+
+/**
+ * Add a level 0 run, then merge SORT_MERGE_FANIN runs of a level into one
+ * of the next while possible. Levels never increase along the array, so
+ * each line is merged O(log runs) times and few files stay open.
+ * @return 0, -1 on error
+ */
+static int sort_add_run(struct sort_run **runs, int *run_count, FILE *run, bool unique)
+{
+  *runs = realloc(*runs, sizeof(struct sort_run) * (*run_count + 1));
+  (*runs)[*run_count].fp = run;
+  (*runs)[(*run_count)++].level = 0;
+  while (*run_count >= SORT_MERGE_FANIN)
+  {
+    struct sort_run *tail = *runs + *run_count - SORT_MERGE_FANIN;
+    if (tail[0].level != tail[SORT_MERGE_FANIN - 1].level)
+      break;
+    if (sort_merge_tail(*runs, run_count, SORT_MERGE_FANIN, tail[0].level + 1, unique) == -1)
+      return -1;
+  }
+  return 0;
+}
+
+static size_t parse_size(const char *s)
+{
+  char *end;
+  size_t n = strtoul(s, &end, 10);
+  switch (*end)
+  {
+  case 'G': case 'g': n <<= 10; // fall through
+  case 'M': case 'm': n <<= 10; // fall through
+  case 'K': case 'k': n <<= 10;
+  }
+  return n;
+}
+
+/**
+ * mysort [-u] [-S size] [--parallel=N] [file]: sort lines bytewise
+ * @param  command command with the options
+ * @return         exit status
+ */
+int mysort(struct command_t *command)
+{
+  bool unique = false;
+  size_t mem_cap = SORT_DEFAULT_MEM;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *file = NULL;
+  for (int i = 0; i < command->arg_count; i++)
+  {
+    const char *a = command->args[i];
+    if (strcmp(a, "-u") == 0 || strcmp(a, "--unique") == 0)
+      unique = true;
+    else if (strcmp(a, "-S") == 0 && i + 1 < command->arg_count)
+      mem_cap = parse_size(command->args[++i]);
+    else if (strncmp(a, "--parallel=", 11) == 0)
+      threads = atol(a + 11);
+    else if (a[0] == '-' && a[1] != 0)
+    {
+      fprintf(stderr, "mysort: unknown option %s\n", a);
+      return 2;
+    }
+    else
+      file = a;
+  }
+  if (threads < 1)
+    threads = 1;
+  if (threads > SORT_MAX_THREADS)
+    threads = SORT_MAX_THREADS;
+  if (mem_cap < IO_BLOCK_SIZE * 2)
+    mem_cap = IO_BLOCK_SIZE * 2;
+
+  int fd = STDIN_FILENO;
+  if (file != NULL && (fd = open(file, O_RDONLY)) == -1)
+  {
+    fprintf(stderr, "mysort: %s: %s\n", file, strerror(errno));
+    return 1;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  struct out_buf *out = malloc(sizeof(struct out_buf));
+  out->fd = STDOUT_FILENO;
+  out->len = 0;
+
+  size_t chunk_cap = mem_cap, chunk_len = 0;
+  char *chunk = malloc(chunk_cap);
+  size_t line_cap = 1024, line_count = 0;
+  struct sort_line *lines = malloc(sizeof(struct sort_line) * line_cap);
+  size_t line_start = 0; // first byte of the line being read
+  struct sort_run *runs = NULL;
+  int run_count = 0;
+  bool eof = false, failed = false;
+
+  while (!eof)
+  {
+    size_t used = chunk_len + line_cap * sizeof(struct sort_line);
+    if (chunk_cap - chunk_len < IO_BLOCK_SIZE ||
+        (line_count > 0 && used + IO_BLOCK_SIZE > mem_cap))
+    {
+      if (line_count == 0) // a single line bigger than the cap
+      {
+        chunk_cap *= 2;
+        chunk = realloc(chunk, chunk_cap);
+        continue;
+      }
+      // chunk full: sort it into a run, keep the unfinished line
+      FILE *run = sort_spill(lines, line_count, threads, unique);
+      if (run == NULL || sort_add_run(&runs, &run_count, run, unique) == -1)
+      {
+        failed = true;
+        break;
+      }
+      memmove(chunk, chunk + line_start, chunk_len - line_start);
+      chunk_len -= line_start;
+      line_start = 0;
+      line_count = 0;
+      if (chunk_cap > mem_cap && chunk_len + IO_BLOCK_SIZE <= mem_cap)
+      {
+        chunk_cap = mem_cap; // grown for a long line, back to the cap
+        chunk = realloc(chunk, chunk_cap);
+      }
+      continue;
+    }
+
+    ssize_t n = read(fd, chunk + chunk_len, IO_BLOCK_SIZE);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+    {
+      eof = true;
+      if (line_start < chunk_len) // last line without a newline
+      {
+        chunk[chunk_len++] = '\n';
+        n = 1;
+      }
+      else
+        break;
+    }
+    else
+      chunk_len += n;
+
+    // lines point into the chunk, chunk is not moved until it is spilled
+    const char *base = chunk;
+    const char *nl, *p = chunk + chunk_len - n, *end = chunk + chunk_len;
+    while ((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+      if (line_count == line_cap &&
+          chunk_len + 2 * line_cap * sizeof(struct sort_line) > mem_cap)
+      {
+        // short lines: no room to grow the line array, spill what is read
+        FILE *run = sort_spill(lines, line_count, threads, unique);
+        if (run == NULL || sort_add_run(&runs, &run_count, run, unique) == -1)
+        {
+          failed = true;
+          break;
+        }
+        size_t scanned = p - base;
+        memmove(chunk, chunk + line_start, chunk_len - line_start);
+        chunk_len -= line_start;
+        p = base + scanned - line_start;
+        end = base + chunk_len;
+        nl -= line_start;
+        line_start = 0;
+        line_count = 0;
+      }
+      else if (line_count == line_cap)
+      {
+        line_cap *= 2;
+        lines = realloc(lines, sizeof(struct sort_line) * line_cap);
+      }
+      lines[line_count].data = base + line_start;
+      lines[line_count++].len = nl - (base + line_start);
+      line_start = nl + 1 - base;
+      p = nl + 1;
+    }
+    if (failed)
+      break;
+  }
+
+  if (!failed && run_count == 0)
+    sort_chunk(lines, line_count, threads, out, unique);
+  else if (!failed)
+  {
+    // spill the last chunk too, then merge all runs
+    FILE *run = sort_spill(lines, line_count, threads, unique);
+    free(chunk);
+    chunk = NULL;
+    failed = run == NULL || sort_add_run(&runs, &run_count, run, unique) == -1;
+    while (!failed && run_count > SORT_MERGE_FANIN)
+      failed = sort_merge_tail(runs, &run_count, SORT_MERGE_FANIN, 0, unique) == -1;
+    if (!failed)
+    {
+      sort_merge_runs(runs, run_count, out, unique);
+      run_count = 0;
+    }
+  }
+  out_flush(out);
+  if (failed)
+    fprintf(stderr, "mysort: temporary run: %s\n", strerror(errno));
+
+  for (int i = 0; i < run_count; i++)
+    fclose(runs[i].fp);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  free(runs);
+  free(chunk);
+  free(lines);
+  free(out);
+  return failed ? 1 : 0;
+}
+
+/*
+ * Chatroom session.
+ * Joining a room does not take the shell over anymore: the transport's fd
+ * is watched by the event loop and incoming messages are printed as they
+ * arrive, while typed lines are sent to the room until /leave or Ctrl+D.
+ * Transports:
+ *  fifo - a named pipe per member in /tmp/chatroom-<room>/, the sender
+ *         writes to every other member's pipe
+ *  sock - a broker process per room, started by the first member, keeps
+ *         a Unix socket connection per member and fans messages out
+ *  shm  - a ring buffer in /dev/shm shared by all members, written once
+ *         and read by everyone without going through the kernel
+ */
+/*
+ * Layout of a shm room. Writers reserve space with a CAS on reserve and
+ * publish a record by storing its position + 1 in stamp last. Readers keep
+ * their own cursor; a record is valid when its stamp matches the cursor,
+ * and still valid after the copy if no writer reserved past cursor + ring
+ * size meanwhile. Writers never wait: a reader that fell a whole ring
+ * behind skips to the newest position and is told how many messages it
+ * lost (lag policy). Every commit bumps futex, which readers sleep on.
+ * A record still uncommitted after CHAT_RING_COMMIT_MS (its writer died)
+ * is skipped up to the next committed one. The last member to leave
+ * marks the ring dead and unlinks it; members that crashed are never
+ * counted out, so their room stays until /dev/shm is cleaned.
+ */
+struct chat_ring_record
+{
+  _Atomic uint64_t stamp; // position + 1 once committed
+  uint64_t seq;           // message number, 0 for padding to the ring end
+  uint32_t len;
+  int32_t sender;
+  uint64_t unused;
+  char data[];
+};
+
+struct chat_ring
+{
+  _Atomic uint64_t reserve; // bytes ever reserved, next record position
+  _Atomic uint64_t seq;
+  _Atomic uint32_t futex;
+  _Atomic uint32_t members; // joined members, CHAT_RING_DEAD once unlinked
+  char data[CHAT_RING_SIZE] __attribute__((aligned(CHAT_RING_ALIGN)));
+};
+
+#define CHAT_RING_DEAD UINT32_MAX
+
+struct chat_transport
+{
+  const char *name;
+  int (*join)();
+  void (*send)(const char *msg, size_t len);
+  void (*leave)();
+};
+
+static struct
+{
+  bool active;
+  const struct chat_transport *transport;
+  char *room, *user;
+  char dir[4096];
+  char pipe_path[4096];
+  int fd;
+  struct chat_ring *ring; // shm transport
+  uint64_t cursor, last_seq;
+  char *ring_msg;          // copy of the record being read
+  uint64_t stall_pos;      // uncommitted record the stall timer waits for
+  int stall_timer;         // -1 when not armed
+  pthread_t waiter;
+  atomic_bool waiting;
+  int log_dir, log_seg_fd, log_idx_fd; // room log, see chat_log_append
+  unsigned log_seg;
+  void (*deliver)(const char *msg, size_t len); // replaces printing, for chatbench
+} chat;
+
+bool chat_active()
+{
+  return chat.active;
+}
+
+bool chat_show_prompt()
+{
+  if (!chat.active)
+    return false;
+  printf("[%s] %s >", chat.room, chat.user);
+  return true;
+}
+
+/**
+ * Print a received message over the prompt
+ */
+static void chat_print(const char *msg, size_t len)
+{
+  if (len > 0 && msg[0] == '\n') // senders start messages on a fresh line
+  {
+    msg++;
+    len--;
+  }
+  if (chat.deliver)
+  {
+    chat.deliver(msg, len);
+    return;
+  }
+  fwrite(msg, 1, len, stdout);
+}
+
+/*
+ * fifo transport
+ * Every member reads its own FIFO in the room directory. Senders keep a
+ * non-blocking write fd per peer, maintained from inotify events on the
+ * directory instead of listing it per message. A message a full pipe
+ * cannot take waits in a bounded per-peer queue, flushed in batches once
+ * the pipe drains, so a member that stopped reading never stalls the room.
+ */
+struct fifo_peer
+{
+  char *name;
+  int fd; // -1 until the peer reads its FIFO
+  char *queue;
+  size_t queued;
+  bool overflowed; // dropping messages until the queue drains
+};
+
+static struct
+{
+  struct fifo_peer *peers;
+  int count;
+  int inotify_fd;
+  char in[2 * CHAT_MSG_MAX]; // a message may span reads
+  size_t in_len;
+} fifo;
+
+static void fifo_receive(int fd, uint32_t events, void *data)
+{
+  ssize_t n;
+  prompt_interrupt_begin();
+  while ((n = read(fd, fifo.in + fifo.in_len, sizeof(fifo.in) - fifo.in_len)) > 0)
+  {
+    fifo.in_len += n;
+    // messages are NUL terminated
+    char *msg = fifo.in, *end;
+    while ((end = memchr(msg, 0, fifo.in + fifo.in_len - msg)) != NULL)
+    {
+      chat_print(msg, end - msg);
+      msg = end + 1;
+    }
+    fifo.in_len -= msg - fifo.in;
+    if (fifo.in_len == sizeof(fifo.in)) // no terminator, not a message
+      fifo.in_len = 0;
+    memmove(fifo.in, msg, fifo.in_len);
+  }
+  prompt_interrupt_end();
+}
+
+static struct fifo_peer *fifo_find_peer(const char *name, int fd)
+{
+  for (int i = 0; i < fifo.count; i++)
+    if (name ? strcmp(fifo.peers[i].name, name) == 0 : fifo.peers[i].fd == fd)
+      return &fifo.peers[i];
+  return NULL;
+}
+
+static void fifo_open_peer(struct fifo_peer *peer)
+{
+  char path[4096 + 256];
+  snprintf(path, sizeof(path), "%s%s", chat.dir, peer->name);
+  // fails with ENXIO while nobody reads it, retried on the next message
+  peer->fd = open(path, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+}
+
+static void fifo_close_peer(struct fifo_peer *peer)
+{
+  if (peer->fd == -1)
+    return;
+  if (peer->queued > 0)
+    loop_remove_fd(peer->fd);
+  close(peer->fd);
+  peer->fd = -1;
+  peer->queued = 0;
+  peer->overflowed = false;
+}
+
+static void fifo_add_peer(const char *name)
+{
+  if (name[0] == '.' || strcmp(name, chat.user) == 0 || fifo_find_peer(name, -1))
+    return;
+  fifo.peers = realloc(fifo.peers, sizeof(struct fifo_peer) * (fifo.count + 1));
+  struct fifo_peer *peer = &fifo.peers[fifo.count++];
+  memset(peer, 0, sizeof(*peer));
+  peer->name = strdup(name);
+  fifo_open_peer(peer);
+}
+
+static void fifo_remove_peer(const char *name)
+{
+  struct fifo_peer *peer = fifo_find_peer(name, -1);
+  if (peer == NULL)
+    return;
+  fifo_close_peer(peer);
+  free(peer->name);
+  free(peer->queue);
+  *peer = fifo.peers[--fifo.count];
+}
+
+static void fifo_scan_room()
+{
+  DIR *d = opendir(chat.dir);
+  struct dirent *dir;
+  if (d == NULL)
+    return;
+  while ((dir = readdir(d)) != NULL)
+    fifo_add_peer(dir->d_name);
+  closedir(d);
+}
+
+/**
+ * Write queued messages in batches of whole messages of up to PIPE_BUF
+ * bytes, which a pipe takes atomically even with several writers
+ * @return false when the peer stopped reading for good
+ */
+static bool fifo_flush_peer(struct fifo_peer *peer)
+{
+  size_t done = 0;
+  while (done < peer->queued)
+  {
+    size_t batch = 0;
+    while (done + batch < peer->queued)
+    {
+      char *msg = peer->queue + done + batch;
+      size_t len = (char *)memchr(msg, 0, peer->queued - done - batch) - msg + 1;
+      if (batch > 0 && batch + len > PIPE_BUF)
+        break;
+      batch += len;
+    }
+    ssize_t w = write(peer->fd, peer->queue + done, batch);
+    if (w == -1)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN)
+        break;
+      return false;
+    }
+    done += w;
+  }
+  memmove(peer->queue, peer->queue + done, peer->queued - done);
+  peer->queued -= done;
+  return true;
+}
+
+static void fifo_writable(int fd, uint32_t events, void *data)
+{
+  struct fifo_peer *peer = fifo_find_peer(NULL, fd);
+  if (peer == NULL)
+    return;
+  if (!fifo_flush_peer(peer))
+    fifo_close_peer(peer);
+  else if (peer->queued == 0)
+  {
+    loop_remove_fd(fd);
+    peer->overflowed = false;
+  }
+}
+
+static void fifo_deliver(struct fifo_peer *peer, const char *msg, size_t len)
+{
+  if (peer->queued == 0) // keep the order: nothing may overtake the queue
+  {
+    ssize_t w = write(peer->fd, msg, len);
+    if (w == (ssize_t)len)
+      return;
+    if (w == -1 && errno != EAGAIN)
+    {
+      fifo_close_peer(peer); // EPIPE, the member left
+      return;
+    }
+  }
+  if (peer->queued + len > CHAT_FIFO_QUEUE_MAX)
+  {
+    if (!peer->overflowed)
+    {
+      prompt_interrupt_begin();
+      printf("*** %s is not reading, dropping messages ***\n", peer->name);
+      prompt_interrupt_end();
+    }
+    peer->overflowed = true;
+    return;
+  }
+  if (peer->queue == NULL)
+    peer->queue = malloc(CHAT_FIFO_QUEUE_MAX);
+  if (peer->queued == 0)
+    loop_add_fd(peer->fd, EPOLLOUT, fifo_writable, NULL);
+  memcpy(peer->queue + peer->queued, msg, len);
+  peer->queued += len;
+}
+
+static void fifo_room_changed(int fd, uint32_t events, void *data)
+{
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+  {
+    for (char *p = buf; p < buf + n;)
+    {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW) // lost events, catch up from the directory
+        fifo_scan_room();
+      else if (ev->len == 0)
+        continue;
+      else if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+        fifo_add_peer(ev->name);
+      else if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+        fifo_remove_peer(ev->name);
+    }
+  }
+}
+
+static int fifo_join()
+{
+  // create user named pipe if doesnt exist
+  snprintf(chat.pipe_path, sizeof(chat.pipe_path), "%s%s", chat.dir, chat.user);
+  if (mkfifo(chat.pipe_path, 0666) == -1 && errno != EEXIST)
+  {
+    printf("Chatroom error named pipe: %s\n", strerror(errno));
+    return -1;
+  }
+
+  // read and write end: the pipe never reports EOF when senders close it
+  chat.fd = open(chat.pipe_path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (chat.fd == -1)
+  {
+    printf("Chatroom error named pipe: %s\n", strerror(errno));
+    return -1;
+  }
+  loop_add_fd(chat.fd, EPOLLIN, fifo_receive, NULL);
+  fifo.in_len = 0;
+
+  // watch before listing, so no member slips in between
+  fifo.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fifo.inotify_fd != -1)
+  {
+    inotify_add_watch(fifo.inotify_fd, chat.dir,
+                      IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM);
+    loop_add_fd(fifo.inotify_fd, EPOLLIN, fifo_room_changed, NULL);
+  }
+  fifo_scan_room();
+  return 0;
+}
+
+static void fifo_send(const char *msg, size_t len)
+{
+  for (int i = 0; i < fifo.count; i++)
+  {
+    struct fifo_peer *peer = &fifo.peers[i];
+    if (peer->fd == -1)
+      fifo_open_peer(peer);
+    if (peer->fd != -1)
+      fifo_deliver(peer, msg, len + 1); // NUL included
+  }
+}
+
+static void fifo_leave()
+{
+  loop_remove_fd(chat.fd);
+  close(chat.fd);
+  unlink(chat.pipe_path); // nobody should write to us anymore
+  if (fifo.inotify_fd != -1)
+  {
+    loop_remove_fd(fifo.inotify_fd);
+    close(fifo.inotify_fd);
+  }
+  while (fifo.count > 0)
+  {
+    struct fifo_peer *peer = &fifo.peers[0];
+    if (peer->queued > 0 && peer->fd != -1)
+      fifo_flush_peer(peer); // last chance, without waiting
+    fifo_remove_peer(peer->name);
+  }
+}
+
+/*
+ * sock transport
+ * SOCK_SEQPACKET keeps message boundaries, so the broker forwards each
+ * packet as is: one send per other member, no filesystem access. The
+ * broker holds a lock on /tmp/chatroom-<room>.lock while it runs, which
+ * makes starting it race free when several members join at once.
+ */
+static void chat_sock_path(const char *room, struct sockaddr_un *addr, char *lock_path,
+                           size_t lock_size)
+{
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  snprintf(addr->sun_path, sizeof(addr->sun_path), "/tmp/chatroom-%s.sock", room);
+  snprintf(lock_path, lock_size, "/tmp/chatroom-%s.lock", room);
+}
+
+/**
+ * Broker main loop, runs in its own daemonized process until the room
+ * stayed empty for CHAT_BROKER_IDLE_MS
+ */
+static void chat_broker_main(const char *room)
+{
+  struct sockaddr_un addr;
+  char lock_path[4096];
+  chat_sock_path(room, &addr, lock_path, sizeof(lock_path));
+
+  int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (lock == -1 || flock(lock, LOCK_EX | LOCK_NB) == -1)
+    exit(0); // another broker owns the room
+  unlink(addr.sun_path); // left over by a broker that died
+  int listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listener == -1 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+      listen(listener, 128) == -1)
+    exit(1);
+  chmod(addr.sun_path, 0666);
+
+  // one fd per member, big rooms outgrow the default soft limit
+  struct rlimit files;
+  if (getrlimit(RLIMIT_NOFILE, &files) == 0)
+  {
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+  }
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = {0};
+  ev.events = EPOLLIN;
+  ev.data.fd = listener;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, listener, &ev);
+
+  int *members = NULL;
+  int member_count = 0, member_cap = 0;
+  char msg[CHAT_MSG_MAX];
+  while (1)
+  {
+    struct epoll_event events[64];
+    int n = epoll_wait(epfd, events, 64, member_count ? -1 : CHAT_BROKER_IDLE_MS);
+    if (n == 0 && member_count == 0)
+      break;
+    for (int i = 0; i < n; i++)
+    {
+      int fd = events[i].data.fd;
+      if (fd == listener)
+      {
+        int client;
+        while ((client = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) != -1)
+        {
+          if (member_count == member_cap)
+          {
+            member_cap = member_cap ? member_cap * 2 : 16;
+            members = realloc(members, sizeof(int) * member_cap);
+          }
+          members[member_count++] = client;
+          ev.events = EPOLLIN;
+          ev.data.fd = client;
+          epoll_ctl(epfd, EPOLL_CTL_ADD, client, &ev);
+        }
+        continue;
+      }
+
+      ssize_t len;
+      while ((len = recv(fd, msg, sizeof(msg), MSG_DONTWAIT)) > 0)
+        for (int k = 0; k < member_count; k++)
+          if (members[k] != fd) // a member too slow to take it misses it
+            send(members[k], msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (len == 0 || (len == -1 && errno != EAGAIN && errno != EINTR))
+      {
+        for (int k = 0; k < member_count; k++)
+          if (members[k] == fd)
+            members[k] = members[--member_count];
+        close(fd); // also drops it from the epoll set
+      }
+    }
+  }
+  unlink(addr.sun_path);
+  exit(0);
+}
+
+/**
+ * Start the broker as a daemon, detached from the shell and its terminal
+ */
+static void chat_start_broker(const char *room)
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    job_default_signals();
+    setsid();
+    if (fork() != 0)
+      _exit(0);
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    dup2(null, STDERR_FILENO);
+    close_range(3, ~0U, 0); // none of the shell's fds belong to the broker
+    chat_broker_main(room);
+  }
+  if (pid > 0)
+    waitpid(pid, NULL, 0);
+}
+
+static void sock_receive(int fd, uint32_t events, void *data)
+{
+  char msg[CHAT_MSG_MAX];
+  ssize_t n;
+  prompt_interrupt_begin();
+  while ((n = recv(fd, msg, sizeof(msg), MSG_DONTWAIT)) > 0)
+    chat_print(msg, n);
+  if (n == 0)
+  {
+    printf("Chatroom broker went away.\n");
+    chat_leave();
+  }
+  prompt_interrupt_end();
+}
+
+static int sock_join()
+{
+  struct sockaddr_un addr;
+  char lock_path[4096];
+  chat_sock_path(chat.room, &addr, lock_path, sizeof(lock_path));
+  chat.fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  for (int attempt = 0; attempt < 50; attempt++)
+  {
+    if (connect(chat.fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    {
+      fcntl(chat.fd, F_SETFL, O_NONBLOCK);
+      loop_add_fd(chat.fd, EPOLLIN, sock_receive, NULL);
+      return 0;
+    }
+    if (attempt == 0)
+      chat_start_broker(chat.room); // first member, or the broker died
+    usleep(20000);
+  }
+  printf("Chatroom error broker: %s\n", strerror(errno));
+  close(chat.fd);
+  return -1;
+}
+
+static void sock_send(const char *msg, size_t len)
+{
+  if (send(chat.fd, msg, len, MSG_NOSIGNAL) == -1)
+    printf("Chatroom error send: %s\n", strerror(errno));
+}
+
+static void sock_leave()
+{
+  loop_remove_fd(chat.fd);
+  close(chat.fd);
+}
+
+/*
+ * shm transport
+ */
+static long chat_futex(_Atomic uint32_t *addr, int op, uint32_t val)
+{
+  // not FUTEX_PRIVATE_FLAG, the word is shared between processes
+  return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static void shm_send(const char *msg, size_t len)
+{
+  struct chat_ring *ring = chat.ring;
+  size_t total = (sizeof(struct chat_ring_record) + len + CHAT_RING_ALIGN - 1) &
+                 ~(size_t)(CHAT_RING_ALIGN - 1);
+  if (total > CHAT_RING_SIZE / 4)
+    return;
+  uint64_t pos, need, pad;
+  do
+  {
+    pos = atomic_load(&ring->reserve);
+    uint64_t off = pos % CHAT_RING_SIZE;
+    pad = off + total > CHAT_RING_SIZE ? CHAT_RING_SIZE - off : 0; // no wrapping records
+    need = pad + total;
+  } while (!atomic_compare_exchange_weak(&ring->reserve, &pos, pos + need));
+
+  if (pad > 0)
+  {
+    struct chat_ring_record *r = (void *)(ring->data + pos % CHAT_RING_SIZE);
+    r->seq = 0;
+    r->len = pad - sizeof(struct chat_ring_record);
+    atomic_store_explicit(&r->stamp, pos + 1, memory_order_release);
+    pos += pad;
+  }
+  struct chat_ring_record *r = (void *)(ring->data + pos % CHAT_RING_SIZE);
+  r->seq = atomic_fetch_add(&ring->seq, 1) + 1;
+  r->len = len;
+  r->sender = getpid();
+  memcpy(r->data, msg, len);
+  atomic_store_explicit(&r->stamp, pos + 1, memory_order_release);
+
+  atomic_fetch_add(&ring->futex, 1);
+  chat_futex(&ring->futex, FUTEX_WAKE, INT32_MAX);
+}
+
+static void shm_stall_expired(int timer, void *data);
+
+/**
+ * Read every committed record after the cursor, runs on the main thread
+ * @param expired the stall timer fired, skip the record it waited for
+ */
+static void shm_drain(bool expired)
+{
+  struct chat_ring *ring = chat.ring;
+  char *msg = chat.ring_msg;
+  size_t msg_cap = CHAT_RING_SIZE / 4;
+  prompt_interrupt_begin();
+  while (1)
+  {
+    uint64_t head = atomic_load(&ring->reserve);
+    if (head == chat.cursor)
+      break;
+    struct chat_ring_record *r = (void *)(ring->data + chat.cursor % CHAT_RING_SIZE);
+    uint64_t stamp = atomic_load_explicit(&r->stamp, memory_order_acquire);
+    bool lagged = head - chat.cursor > CHAT_RING_SIZE;
+    uint64_t seq = 0;
+    size_t len = 0;
+    if (!lagged && stamp != chat.cursor + 1)
+    {
+      // reserved but not committed yet, the commit will wake us
+      if (!expired || chat.stall_pos != chat.cursor)
+      {
+        if (chat.stall_timer == -1)
+        {
+          chat.stall_pos = chat.cursor;
+          chat.stall_timer = loop_add_timer(CHAT_RING_COMMIT_MS, 0, shm_stall_expired, NULL);
+        }
+        break;
+      }
+      // its writer is gone, resume at the next committed record
+      uint64_t next = chat.cursor + CHAT_RING_ALIGN;
+      for (; next < head; next += CHAT_RING_ALIGN)
+      {
+        struct chat_ring_record *n = (void *)(ring->data + next % CHAT_RING_SIZE);
+        if (atomic_load_explicit(&n->stamp, memory_order_acquire) == next + 1)
+          break;
+      }
+      if (next >= head)
+      {
+        chat.stall_timer = loop_add_timer(CHAT_RING_COMMIT_MS, 0, shm_stall_expired, NULL);
+        break;
+      }
+      printf("*** skipped a message its sender never finished ***\n");
+      chat.cursor = next;
+      continue;
+    }
+    if (!lagged)
+    {
+      seq = r->seq;
+      len = r->len;
+      if (seq != 0 && len <= msg_cap)
+        memcpy(msg, r->data, len);
+      int32_t sender = r->sender;
+      atomic_thread_fence(memory_order_acquire);
+      // overwritten while copying if a writer reserved past it meanwhile
+      lagged = atomic_load(&ring->reserve) - chat.cursor > CHAT_RING_SIZE ||
+               len > msg_cap;
+      if (!lagged && seq != 0 && sender != getpid())
+        chat_print(msg, len);
+    }
+    if (lagged)
+    {
+      uint64_t newest = atomic_load(&ring->seq);
+      printf("*** fell behind, %llu message(s) lost ***\n",
+             (unsigned long long)(newest - chat.last_seq));
+      chat.cursor = atomic_load(&ring->reserve);
+      chat.last_seq = newest;
+      continue;
+    }
+    if (seq != 0)
+      chat.last_seq = seq;
+    chat.cursor += (sizeof(struct chat_ring_record) + len + CHAT_RING_ALIGN - 1) &
+                   ~(uint64_t)(CHAT_RING_ALIGN - 1);
+  }
+  prompt_interrupt_end();
+}
+
+static void shm_receive(int fd, uint32_t events, void *data)
+{
+  uint64_t ticks;
+  read(fd, &ticks, sizeof(ticks));
+  shm_drain(false);
+}
+
+static void shm_stall_expired(int timer, void *data)
+{
+  chat.stall_timer = -1;
+  shm_drain(true);
+}
+
+/**
+ * Sleeps on the ring futex and pokes the main loop's eventfd on changes
+ */
+static void *shm_waiter_thread(void *arg)
+{
+  int efd = (intptr_t)arg;
+  uint64_t one = 1;
+  while (atomic_load(&chat.waiting))
+  {
+    uint32_t seen = atomic_load(&chat.ring->futex);
+    write(efd, &one, sizeof(one)); // main thread checks the ring
+    chat_futex(&chat.ring->futex, FUTEX_WAIT, seen); // returns at once if bumped
+  }
+  return NULL;
+}
+
+static int shm_join()
+{
+  char name[256];
+  snprintf(name, sizeof(name), "/shellax-chat-%s", chat.room);
+  while (1)
+  {
+    int shm = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (shm == -1 || ftruncate(shm, sizeof(struct chat_ring)) == -1)
+    {
+      printf("Chatroom error shared memory: %s\n", strerror(errno));
+      if (shm != -1)
+        close(shm);
+      return -1;
+    }
+    // a new segment is zero filled, which is a valid empty ring
+    chat.ring = mmap(NULL, sizeof(struct chat_ring), PROT_READ | PROT_WRITE, MAP_SHARED,
+                     shm, 0);
+    close(shm);
+    if (chat.ring == MAP_FAILED)
+    {
+      printf("Chatroom error shared memory: %s\n", strerror(errno));
+      return -1;
+    }
+    uint32_t members = atomic_load(&chat.ring->members);
+    while (members != CHAT_RING_DEAD &&
+           !atomic_compare_exchange_weak(&chat.ring->members, &members, members + 1))
+      ;
+    if (members != CHAT_RING_DEAD)
+      break;
+    // the last member is unlinking it, open the next one
+    munmap(chat.ring, sizeof(struct chat_ring));
+    usleep(1000);
+  }
+  chat.ring_msg = malloc(CHAT_RING_SIZE / 4);
+  chat.stall_timer = -1;
+  chat.cursor = atomic_load(&chat.ring->reserve); // only new messages
+  chat.last_seq = atomic_load(&chat.ring->seq);
+  chat.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  loop_add_fd(chat.fd, EPOLLIN, shm_receive, NULL);
+  atomic_store(&chat.waiting, true);
+  pthread_create(&chat.waiter, NULL, shm_waiter_thread, (void *)(intptr_t)chat.fd);
+  return 0;
+}
+
+static void shm_leave()
+{
+  atomic_store(&chat.waiting, false);
+  atomic_fetch_add(&chat.ring->futex, 1);
+  chat_futex(&chat.ring->futex, FUTEX_WAKE, INT32_MAX);
+  pthread_join(chat.waiter, NULL);
+  loop_remove_fd(chat.fd);
+  close(chat.fd);
+  if (chat.stall_timer != -1)
+    loop_cancel_timer(chat.stall_timer);
+  free(chat.ring_msg);
+
+  uint32_t members = atomic_load(&chat.ring->members);
+  while (!atomic_compare_exchange_weak(&chat.ring->members, &members,
+                                       members == 1 ? CHAT_RING_DEAD : members - 1))
+    ;
+  if (members == 1) // last one out, joiners seeing dead retry with a new ring
+  {
+    char name[256];
+    snprintf(name, sizeof(name), "/shellax-chat-%s", chat.room);
+    shm_unlink(name);
+  }
+  munmap(chat.ring, sizeof(struct chat_ring));
+}
+
+static const struct chat_transport chat_transports[] = {
+    {"fifo", fifo_join, fifo_send, fifo_leave},
+    {"sock", sock_join, sock_send, sock_leave},
+    {"shm", shm_join, shm_send, shm_leave},
+    {NULL, NULL, NULL, NULL},
+};
+
+/*
+ * Room log: every message is appended to /tmp/chatroom-<room>.log/ so that
+ * joining members can replay history. The log is a series of segments
+ * (NNNNNNNN.seg) with a header counting their records, each with a sparse
+ * index (NNNNNNNN.idx) holding the time and offset of every
+ * CHAT_LOG_INDEX_EVERY-th record, so replay seeks instead of scanning.
+ * Appends are serialized with a flock on the directory; the writer that
+ * fills a segment seals it, starts the next one and deletes the oldest.
+ */
+struct chat_log_header
+{
+  char magic[8];
+  uint64_t count;
+  int64_t first_ts; // ns since the epoch
+  uint32_t sealed;
+  uint32_t unused;
+};
+
+struct chat_log_record
+{
+  uint32_t len;
+  uint32_t unused;
+  int64_t ts;
+  char data[];
+};
+
+struct chat_log_index
+{
+  int64_t ts;
+  uint64_t ordinal; // record number in the segment
+  uint64_t offset;
+};
+
+struct chat_log_view
+{
+  struct chat_log_header header;
+  char *data;
+  size_t size;
+  struct chat_log_index *index;
+  size_t index_count;
+};
+
+static const char chat_log_magic[8] = "SHXLOG1";
+
+static size_t chat_log_record_size(size_t len)
+{
+  return (sizeof(struct chat_log_record) + len + 7) & ~(size_t)7;
+}
+
+static int64_t chat_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int chat_log_compare_segments(const void *a, const void *b)
+{
+  unsigned x = *(const unsigned *)a, y = *(const unsigned *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * List the segment numbers of the room log in ascending order
+ * @return number of segments
+ */
+static int chat_log_segments(unsigned *segs, int max)
+{
+  int fd = openat(chat.log_dir, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *dir = fd == -1 ? NULL : fdopendir(fd);
+  if (dir == NULL)
+    return 0;
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL && count < max)
+  {
+    unsigned seg;
+    char ext[4];
+    if (sscanf(entry->d_name, "%8u.%3s", &seg, ext) == 2 && strcmp(ext, "seg") == 0)
+      segs[count++] = seg;
+  }
+  closedir(dir);
+  qsort(segs, count, sizeof(unsigned), chat_log_compare_segments);
+  return count;
+}
+
+/**
+ * Open a segment and its index for appending, creating them if needed
+ */
+static int chat_log_open_segment(unsigned seg)
+{
+  char name[32];
+  snprintf(name, sizeof(name), "%08u.seg", seg);
+  chat.log_seg_fd = openat(chat.log_dir, name, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  snprintf(name, sizeof(name), "%08u.idx", seg);
+  chat.log_idx_fd =
+      openat(chat.log_dir, name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (chat.log_seg_fd == -1 || chat.log_idx_fd == -1)
+    return -1;
+  chat.log_seg = seg;
+  struct stat st;
+  if (fstat(chat.log_seg_fd, &st) == 0 && st.st_size == 0)
+  {
+    struct chat_log_header header = {0};
+    memcpy(header.magic, chat_log_magic, sizeof(header.magic));
+    pwrite(chat.log_seg_fd, &header, sizeof(header), 0);
+  }
+  return 0;
+}
+
+static void chat_log_close_segment()
+{
+  if (chat.log_seg_fd != -1)
+    close(chat.log_seg_fd);
+  if (chat.log_idx_fd != -1)
+    close(chat.log_idx_fd);
+  chat.log_seg_fd = chat.log_idx_fd = -1;
+}
+
+/**
+ * Seal the full segment, start the next one and apply retention
+ */
+static void chat_log_rotate(struct chat_log_header *header)
+{
+  header->sealed = 1;
+  pwrite(chat.log_seg_fd, header, sizeof(*header), 0);
+  chat_log_close_segment();
+  chat_log_open_segment(chat.log_seg + 1);
+
+  unsigned segs[256];
+  int count = chat_log_segments(segs, 256);
+  for (int i = 0; i < count && segs[i] + CHAT_LOG_SEGMENTS_KEPT <= chat.log_seg; i++)
+  {
+    char name[32];
+    snprintf(name, sizeof(name), "%08u.seg", segs[i]);
+    unlinkat(chat.log_dir, name, 0);
+    snprintf(name, sizeof(name), "%08u.idx", segs[i]);
+    unlinkat(chat.log_dir, name, 0);
+  }
+}
+
+/**
+ * Append a message to the room log
+ */
+static void chat_log_append(const char *msg, size_t len)
+{
+  if (chat.log_dir == -1)
+    return;
+  flock(chat.log_dir, LOCK_EX);
+  struct chat_log_header header;
+  if (chat.log_seg_fd == -1 ||
+      pread(chat.log_seg_fd, &header, sizeof(header), 0) != sizeof(header) ||
+      header.sealed)
+  {
+    // first message, or another member rotated: append to the newest
+    unsigned segs[256];
+    int count = chat_log_segments(segs, 256);
+    chat_log_close_segment();
+    if (chat_log_open_segment(count > 0 ? segs[count - 1] : 1) == -1 ||
+        pread(chat.log_seg_fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+      chat_log_close_segment();
+      flock(chat.log_dir, LOCK_UN);
+      return;
+    }
+  }
+
+  struct stat st;
+  fstat(chat.log_seg_fd, &st);
+  int64_t now = chat_now_ns();
+  if (header.count == 0)
+    header.first_ts = now;
+  if (header.count % CHAT_LOG_INDEX_EVERY == 0)
+  {
+    struct chat_log_index entry = {now, header.count, st.st_size};
+    write(chat.log_idx_fd, &entry, sizeof(entry));
+  }
+  struct chat_log_record record = {len, 0, now};
+  char padding[8] = {0};
+  size_t size = chat_log_record_size(len);
+  struct iovec iov[3] = {{&record, sizeof(record)},
+                         {(void *)msg, len},
+                         {padding, size - sizeof(record) - len}};
+  pwritev(chat.log_seg_fd, iov, 3, st.st_size);
+  header.count++; // after the record, readers trust only counted records
+  pwrite(chat.log_seg_fd, &header, sizeof(header), 0);
+
+  if (st.st_size + size >= CHAT_LOG_SEGMENT_MAX)
+    chat_log_rotate(&header);
+  flock(chat.log_dir, LOCK_UN);
+}
+
+/**
+ * Map a segment and its index for reading
+ */
+static int chat_log_view_open(unsigned seg, struct chat_log_view *view)
+{
+  memset(view, 0, sizeof(*view));
+  char name[32];
+  snprintf(name, sizeof(name), "%08u.seg", seg);
+  int fd = openat(chat.log_dir, name, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1; // deleted by retention meanwhile
+  struct stat st;
+  // header first: records it counts were completely written before it
+  if (pread(fd, &view->header, sizeof(view->header), 0) != sizeof(view->header) ||
+      memcmp(view->header.magic, chat_log_magic, sizeof(chat_log_magic)) != 0 ||
+      fstat(fd, &st) == -1)
+  {
+    close(fd);
+    return -1;
+  }
+  view->size = st.st_size;
+  view->data = mmap(NULL, view->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (view->data == MAP_FAILED)
+    return -1;
+
+  snprintf(name, sizeof(name), "%08u.idx", seg);
+  fd = openat(chat.log_dir, name, O_RDONLY | O_CLOEXEC);
+  if (fd != -1 && fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct chat_log_index))
+  {
+    view->index_count = st.st_size / sizeof(struct chat_log_index);
+    view->index = mmap(NULL, view->index_count * sizeof(struct chat_log_index), PROT_READ,
+                       MAP_SHARED, fd, 0);
+    if (view->index == MAP_FAILED)
+    {
+      view->index = NULL;
+      view->index_count = 0;
+    }
+  }
+  if (fd != -1)
+    close(fd);
+  return 0;
+}
+
+static void chat_log_view_close(struct chat_log_view *view)
+{
+  munmap(view->data, view->size);
+  if (view->index)
+    munmap(view->index, view->index_count * sizeof(struct chat_log_index));
+}
+
+/**
+ * Print the records of a segment from the first one at or after ordinal
+ * and time since, seeking through the sparse index
+ */
+static void chat_log_replay_segment(struct chat_log_view *view, uint64_t ordinal,
+                                    int64_t since, struct out_buf *out)
+{
+  // last index entry before the start, entries are in ordinal and time order;
+  // count replays pass since = INT64_MIN, time replays ordinal = 0
+  bool by_count = since == INT64_MIN;
+  size_t lo = 0, hi = view->index_count;
+  while (lo < hi)
+  {
+    size_t mid = (lo + hi) / 2;
+    if (by_count ? view->index[mid].ordinal <= ordinal : view->index[mid].ts < since)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  uint64_t n = 0;
+  size_t offset = sizeof(struct chat_log_header);
+  if (lo > 0)
+  {
+    n = view->index[lo - 1].ordinal;
+    offset = view->index[lo - 1].offset;
+  }
+
+  for (; n < view->header.count; n++)
+  {
+    if (offset + sizeof(struct chat_log_record) > view->size)
+      break;
+    struct chat_log_record *record = (void *)(view->data + offset);
+    size_t size = chat_log_record_size(record->len);
+    if (offset + size > view->size)
+      break;
+    offset += size;
+    if (n < ordinal || record->ts < since)
+      continue;
+
+    char stamp[32];
+    time_t secs = record->ts / 1000000000LL;
+    struct tm tm;
+    int len = strftime(stamp, sizeof(stamp), "%m-%d %H:%M ", localtime_r(&secs, &tm));
+    out_write(out, stamp, len);
+    out_write(out, record->data, record->len);
+    out_write(out, "\n", 1);
+  }
+}
+
+/**
+ * Replay the room log: the last count messages, or when count is -1 the
+ * messages since a time in ns
+ */
+static void chat_log_replay(long count, int64_t since)
+{
+  unsigned segs[256];
+  int segments = chat_log_segments(segs, 256);
+  if (segments == 0)
+    return;
+
+  struct chat_log_view view;
+  int first = 0;
+  uint64_t ordinal = 0;
+  if (count >= 0)
+  {
+    // walk back through the record counts of the newest segments
+    uint64_t remaining = count;
+    for (first = segments - 1; first >= 0; first--)
+    {
+      if (chat_log_view_open(segs[first], &view) == -1)
+        break;
+      uint64_t records = view.header.count;
+      chat_log_view_close(&view);
+      if (records >= remaining)
+      {
+        ordinal = records - remaining;
+        break;
+      }
+      remaining -= records;
+    }
+    if (first < 0) // fewer messages logged than asked for
+      first = 0;
+    since = INT64_MIN;
+  }
+  else
+  {
+    // last segment starting at or before since
+    int lo = 0, hi = segments;
+    while (lo < hi)
+    {
+      int mid = (lo + hi) / 2;
+      if (chat_log_view_open(segs[mid], &view) == -1)
+      {
+        lo = mid + 1;
+        continue;
+      }
+      bool before = view.header.count > 0 && view.header.first_ts <= since;
+      chat_log_view_close(&view);
+      if (before)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    first = lo > 0 ? lo - 1 : 0;
+  }
+
+  fflush(stdout);
+  struct out_buf *out = malloc(sizeof(struct out_buf));
+  out->fd = STDOUT_FILENO;
+  out->len = 0;
+  for (int i = first; i < segments; i++)
+  {
+    if (chat_log_view_open(segs[i], &view) == -1)
+      continue;
+    chat_log_replay_segment(&view, i == first ? ordinal : 0, since, out);
+    chat_log_view_close(&view);
+  }
+  out_flush(out);
+  free(out);
+}
+
+/**
+ * Parse a replay start: seconds since the epoch, or a duration ago with an
+ * s, m, h or d suffix
+ * @return time in ns, or -1 when malformed
+ */
+static int64_t chat_parse_since(const char *arg)
+{
+  char *end;
+  long long value = strtoll(arg, &end, 10);
+  if (end == arg || value < 0)
+    return -1;
+  long long unit;
+  switch (*end)
+  {
+  case '\0':
+    return value * 1000000000LL;
+  case 's':
+    unit = 1;
+    break;
+  case 'm':
+    unit = 60;
+    break;
+  case 'h':
+    unit = 3600;
+    break;
+  case 'd':
+    unit = 86400;
+    break;
+  default:
+    return -1;
+  }
+  if (end[1] != '\0')
+    return -1;
+  return chat_now_ns() - value * unit * 1000000000LL;
+}
+
+/**
+ * Send a typed line to every other member of the room
+ */
+void chat_line(const char *line)
+{
+  if (strcmp(line, "/leave") == 0)
+  {
+    chat_leave();
+    return;
+  }
+
+  char temp_buff[CHAT_MSG_MAX];
+  int len = snprintf(temp_buff, sizeof(temp_buff), "\n[%s] %s: %s\n", chat.room,
+                     chat.user, line);
+  if (len >= (int)sizeof(temp_buff))
+  {
+    len = sizeof(temp_buff) - 1; // cut, but still end the line
+    temp_buff[len - 1] = '\n';
+  }
+  chat.transport->send(temp_buff, len);
+  chat_log_append(temp_buff + 1, len - 2); // without the surrounding newlines
+}
+
+void chat_leave()
+{
+  if (!chat.active)
+    return;
+  chat.transport->leave();
+  chat_log_close_segment();
+  if (chat.log_dir != -1)
+    close(chat.log_dir);
+  printf("Left %s.\n", chat.room);
+  free(chat.room);
+  free(chat.user);
+  chat.active = false;
+}
+
+/**
+ * chatroom [-t fifo|sock|shm] [-n count | -s since] <room> <user>: join a
+ * room, replaying the last count messages or those since a time
+ */
+int chatroom(struct command_t *command)
+{
+  const struct chat_transport *transport = &chat_transports[0];
+  long replay_count = 0;
+  int64_t replay_since = -1;
+  int argi = 0;
+  // options take a value, and room and user must follow
+  while (command->arg_count - argi >= 4 && command->args[argi][0] == '-')
+  {
+    const char *option = command->args[argi], *value = command->args[argi + 1];
+    if (strcmp(option, "-t") == 0)
+    {
+      transport = NULL;
+      for (int i = 0; chat_transports[i].name; i++)
+        if (strcmp(chat_transports[i].name, value) == 0)
+          transport = &chat_transports[i];
+      if (transport == NULL)
+      {
+        printf("Chatroom error: unknown transport %s\n", value);
+        return UNKNOWN;
+      }
+    }
+    else if (strcmp(option, "-n") == 0)
+    {
+      replay_count = atol(value);
+      replay_since = -1;
+    }
+    else if (strcmp(option, "-s") == 0)
+    {
+      replay_since = chat_parse_since(value);
+      if (replay_since == -1)
+      {
+        printf("Chatroom error: bad time %s\n", value);
+        return UNKNOWN;
+      }
+      replay_count = -1;
+    }
+    else
+      break;
+    argi += 2;
+  }
+  if (command->arg_count - argi < 2)
+  {
+    printf("Chatroom error: usage: chatroom [-t transport] [-n count | -s since] room user\n");
+    return UNKNOWN;
+  }
+  const char *room = command->args[argi], *user = command->args[argi + 1];
+  if (shell_batch) // messages are typed at the prompt
+  {
+    printf("Chatroom error: needs an interactive shell\n");
+    return UNKNOWN;
+  }
+
+  if (chat.active)
+    chat_leave();
+
+  char chatroom_dir[100];
+  strcpy(chatroom_dir, "/tmp");
+  // create tmp folder if doesnt exist
+  if (mkdir(chatroom_dir, S_IRWXU | S_IRWXG | S_IRWXO) == -1)
+  {
+    if (errno != EEXIST)
+    {
+      printf("Chatroom error tmp folder: %s\n", strerror(errno));
+    }
+  }
+  snprintf(chat.dir, sizeof(chat.dir), "%s/chatroom-%s/", chatroom_dir, room);
+
+  // create room folder if doesnt exist
+  if (mkdir(chat.dir, S_IRWXU | S_IRWXG | S_IRWXO) == -1)
+  {
+    if (errno != EEXIST)
+    {
+      printf("Chatroom error room folder: %s\n", strerror(errno));
+    }
+  }
+
+  chat.room = strdup(room);
+  chat.user = strdup(user);
+  chat.transport = transport;
+  if (transport->join() == -1)
+  {
+    free(chat.room);
+    free(chat.user);
+    return UNKNOWN;
+  }
+  chat.active = true;
+
+  char log_path[4096];
+  snprintf(log_path, sizeof(log_path), "%s/chatroom-%s.log", chatroom_dir, room);
+  if (mkdir(log_path, S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST)
+    printf("Chatroom error log folder: %s\n", strerror(errno));
+  chat.log_dir = open(log_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  chat.log_seg_fd = chat.log_idx_fd = -1;
+
+  printf("Welcome to %s! Type /leave or Ctrl+D to leave.\n", room);
+  if (chat.log_dir != -1 && (replay_count > 0 || replay_since != -1))
+    chat_log_replay(replay_count, replay_since);
+  return SUCCESS;
+}
+
+/*
+ * chatbench: load generator for the chat transports. Every simulated user
+ * is a forked process that joins the room through the transport, sends
+ * stamped messages at a fixed rate and records the delivery latency of the
+ * other users' messages in a log-linear histogram in shared memory.
+ */
+#define BENCH_HIST_BUCKETS 640
+
+struct bench_result
+{
+  uint64_t sent, received, truncated, cpu_ns;
+  uint64_t hist[BENCH_HIST_BUCKETS]; // latency, see bench_bucket
+};
+
+struct bench_shared
+{
+  _Atomic int ready;
+  _Atomic int64_t start_ns; // 0 until every user joined
+  struct bench_result results[];
+};
+
+static struct
+{
+  struct bench_result *result;
+  int user;
+  size_t size;
+  int64_t end_ns;
+  uint64_t seq;
+} bench;
+
+static int64_t bench_now_ns()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * Histogram bucket of a latency: 16 us wide below 1 ms, then 16 buckets
+ * per power of two, about 6% precision
+ */
+static int bench_bucket(uint64_t us)
+{
+  if (us < 1024)
+    return us / 16;
+  int e = 63 - __builtin_clzll(us);
+  int b = 64 + (e - 10) * 16 + (int)((us >> (e - 4)) & 15);
+  return b < BENCH_HIST_BUCKETS ? b : BENCH_HIST_BUCKETS - 1;
+}
+
+/**
+ * Upper bound of a histogram bucket in us
+ */
+static uint64_t bench_bucket_value(int b)
+{
+  if (b < 64)
+    return (b + 1) * 16;
+  int e = (b - 64) / 16 + 10, sub = (b - 64) % 16;
+  return (16ULL + sub + 1) << (e - 4);
+}
+
+static void bench_deliver(const char *msg, size_t len)
+{
+  char buf[CHAT_MSG_MAX + 1];
+  if (len > CHAT_MSG_MAX)
+    len = CHAT_MSG_MAX;
+  memcpy(buf, msg, len);
+  buf[len] = 0;
+  int sender;
+  unsigned long long seq;
+  long long sent_ns;
+  size_t size;
+  if (sscanf(buf, "B %d %llu %lld %zu", &sender, &seq, &sent_ns, &size) != 4)
+  {
+    bench.result->truncated++;
+    return;
+  }
+  if (sender == bench.user)
+    return;
+  if (size != len + 1) // chat_print dropped the leading newline
+    bench.result->truncated++;
+  bench.result->received++;
+  int64_t latency = bench_now_ns() - sent_ns;
+  bench.result->hist[bench_bucket(latency > 0 ? latency / 1000 : 0)]++;
+}
+
+static void bench_send(int timer, void *data)
+{
+  const struct chat_transport *transport = data;
+  if (bench_now_ns() >= bench.end_ns)
+  {
+    loop_cancel_timer(timer);
+    return;
+  }
+  char msg[CHAT_MSG_MAX];
+  int len = snprintf(msg, sizeof(msg), "\nB %d %llu %lld %zu ", bench.user,
+                     (unsigned long long)++bench.seq, (long long)bench_now_ns(), bench.size);
+  memset(msg + len, 'x', bench.size - 1 - len);
+  msg[bench.size - 1] = '\n';
+  msg[bench.size] = 0; // the fifo transport sends the terminator too
+  transport->send(msg, bench.size);
+  bench.result->sent++;
+}
+
+/**
+ * Body of a simulated user, never returns
+ */
+static void bench_user(const struct chat_transport *transport, struct bench_shared *shared,
+                       int user, int rate, int seconds)
+{
+  // a loop of our own, the shell's fds are not ours to handle
+  close(loop.epfd);
+  free(loop.handlers);
+  loop.handlers = NULL;
+  loop.size = loop.always_ready_count = 0;
+  loop_init();
+  editor.active = false;
+  int null = open("/dev/null", O_WRONLY);
+  dup2(null, STDOUT_FILENO);
+  close(null);
+
+  char name[32];
+  snprintf(name, sizeof(name), "bench%d", user);
+  chat.user = name;
+  chat.transport = transport;
+  chat.deliver = bench_deliver;
+  bench.user = user;
+  bench.result = &shared->results[user];
+  int joined = transport->join();
+  atomic_fetch_add(&shared->ready, 1);
+  if (joined == -1)
+    _exit(1);
+
+  while (atomic_load(&shared->start_ns) == 0)
+    loop_iterate(1);
+  int64_t start = atomic_load(&shared->start_ns);
+  bench.end_ns = start + seconds * 1000000000LL;
+  int interval = 1000 / rate;
+  // spread the users over the interval instead of sending in bursts
+  loop_add_timer(1 + user % interval, interval, bench_send, (void *)transport);
+  while (bench_now_ns() < bench.end_ns + 1000000000LL) // then a second to drain
+    loop_iterate(100);
+  transport->leave();
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  bench.result->cpu_ns = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000000ULL +
+                         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1000ULL;
+  fflush(stdout);
+  _exit(0);
+}
+
+/**
+ * chatbench [-t transport] [-u users] [-r rate] [-d seconds] [-s size]
+ *           [-f text|csv|json] [room]: measure a chat transport
+ */
+int chatbench(struct command_t *command)
+{
+  const struct chat_transport *transport = &chat_transports[0];
+  int users = 10, rate = 10, seconds = 5;
+  size_t size = 64;
+  const char *format = "text", *room = "bench";
+  for (int i = 0; i < command->arg_count; i++)
+  {
+    const char *arg = command->args[i];
+    const char *value = i + 1 < command->arg_count ? command->args[i + 1] : NULL;
+    if (arg[0] != '-')
+    {
+      room = arg;
+      continue;
+    }
+    if (value == NULL)
+    {
+      printf("-%s: chatbench: %s needs a value\n", sysname, arg);
+      return UNKNOWN;
+    }
+    i++;
+    if (strcmp(arg, "-t") == 0)
+    {
+      transport = NULL;
+      for (int t = 0; chat_transports[t].name; t++)
+        if (strcmp(chat_transports[t].name, value) == 0)
+          transport = &chat_transports[t];
+      if (transport == NULL)
+      {
+        printf("-%s: chatbench: unknown transport %s\n", sysname, value);
+        return UNKNOWN;
+      }
+    }
+    else if (strcmp(arg, "-u") == 0)
+      users = atoi(value);
+    else if (strcmp(arg, "-r") == 0)
+      rate = atoi(value);
+    else if (strcmp(arg, "-d") == 0)
+      seconds = atoi(value);
+    else if (strcmp(arg, "-s") == 0)
+      size = atol(value);
+    else if (strcmp(arg, "-f") == 0)
+      format = value;
+    else
+    {
+      printf("-%s: chatbench: unknown option %s\n", sysname, arg);
+      return UNKNOWN;
+    }
+  }
+  if (users < 1 || users > 1000 || rate < 1 || rate > 1000 || seconds < 1 || size < 64 ||
+      size >= CHAT_MSG_MAX)
+  {
+    printf("-%s: chatbench: users 1-1000, rate 1-1000/s, size 64-%d bytes\n", sysname,
+           CHAT_MSG_MAX - 1);
+    return UNKNOWN;
+  }
+
+  snprintf(chat.dir, sizeof(chat.dir), "/tmp/chatroom-%s/", room);
+  if (mkdir(chat.dir, S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST)
+  {
+    printf("-%s: chatbench: %s: %s\n", sysname, chat.dir, strerror(errno));
+    return UNKNOWN;
+  }
+  char *saved_room = chat.room;
+  chat.room = (char *)room;
+
+  size_t shared_size = sizeof(struct bench_shared) + users * sizeof(struct bench_result);
+  struct bench_shared *shared =
+      mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  pid_t *pids = malloc(users * sizeof(pid_t));
+  bench.size = size;
+  fflush(stdout);
+  for (int i = 0; i < users; i++)
+  {
+    pids[i] = fork();
+    if (pids[i] == -1) // counted as failed, do not wait for it to be ready
+      atomic_fetch_add(&shared->ready, 1);
+    if (pids[i] == 0)
+    {
+      job_default_signals(); // Ctrl+C stops the benchmark
+      signal(SIGPIPE, SIG_IGN);
+      bench_user(transport, shared, i, rate, seconds);
+    }
+  }
+  chat.room = saved_room;
+
+  // start together once everyone joined, or gave up joining
+  for (int waited = 0; atomic_load(&shared->ready) < users && waited < 30000; waited++)
+    usleep(1000);
+  atomic_store(&shared->start_ns, bench_now_ns());
+
+  int failed = 0;
+  for (int i = 0; i < users; i++)
+  {
+    int status = 0;
+    pid_t waited = -1;
+    if (pids[i] > 0) // waitpid(-1) would reap any child, not a failed fork
+      while ((waited = waitpid(pids[i], &status, 0)) == -1 && errno == EINTR)
+        ;
+    if (waited == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      failed++;
+  }
+  free(pids);
+
+  struct bench_result total = {0};
+  for (int i = 0; i < users; i++)
+  {
+    struct bench_result *r = &shared->results[i];
+    total.sent += r->sent;
+    total.received += r->received;
+    total.truncated += r->truncated;
+    total.cpu_ns += r->cpu_ns;
+    for (int b = 0; b < BENCH_HIST_BUCKETS; b++)
+      total.hist[b] += r->hist[b];
+  }
+  munmap(shared, shared_size);
+
+  // every message is due to every other user that joined
+  int joined = users - failed;
+  uint64_t expected = joined > 0 ? total.sent * (joined - 1) : 0;
+  uint64_t lost = expected > total.received ? expected - total.received : 0;
+  const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+  uint64_t latency[5] = {0};
+  uint64_t seen = 0;
+  int q = 0;
+  for (int b = 0; b < BENCH_HIST_BUCKETS && q < 5; b++)
+  {
+    seen += total.hist[b];
+    while (q < 5 && total.received > 0 && seen >= quantiles[q] * total.received)
+      latency[q++] = bench_bucket_value(b);
+  }
+  double rate_out = (double)total.received / seconds;
+  double cpu_us = total.sent ? total.cpu_ns / 1000.0 / total.sent : 0;
+
+  if (strcmp(format, "csv") == 0)
+  {
+    printf("transport,users,rate,seconds,size,failed,sent,delivered,expected,lost,"
+           "truncated,deliveries_per_s,p50_us,p90_us,p99_us,p999_us,max_us,cpu_us_per_msg\n");
+    printf("%s,%d,%d,%d,%zu,%d,%llu,%llu,%llu,%llu,%llu,%.1f,%llu,%llu,%llu,%llu,%llu,%.2f\n",
+           transport->name, users, rate, seconds, size, failed,
+           (unsigned long long)total.sent, (unsigned long long)total.received,
+           (unsigned long long)expected, (unsigned long long)lost,
+           (unsigned long long)total.truncated, rate_out, (unsigned long long)latency[0],
+           (unsigned long long)latency[1], (unsigned long long)latency[2],
+           (unsigned long long)latency[3], (unsigned long long)latency[4], cpu_us);
+  }
+  else if (strcmp(format, "json") == 0)
+  {
+    printf("{\"transport\":\"%s\",\"users\":%d,\"rate\":%d,\"seconds\":%d,\"size\":%zu,"
+           "\"failed\":%d,\"sent\":%llu,\"delivered\":%llu,\"expected\":%llu,\"lost\":%llu,"
+           "\"truncated\":%llu,\"deliveries_per_s\":%.1f,\"latency_us\":{\"p50\":%llu,"
+           "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu},\"cpu_us_per_msg\":%.2f}\n",
+           transport->name, users, rate, seconds, size, failed,
+           (unsigned long long)total.sent, (unsigned long long)total.received,
+           (unsigned long long)expected, (unsigned long long)lost,
+           (unsigned long long)total.truncated, rate_out, (unsigned long long)latency[0],
+           (unsigned long long)latency[1], (unsigned long long)latency[2],
+           (unsigned long long)latency[3], (unsigned long long)latency[4], cpu_us);
+  }
+  else
+  {
+    printf("%s: %d users (%d failed to join), %d msg/s each for %d s, %zu bytes\n",
+           transport->name, users, failed, rate, seconds, size);
+    printf("sent %llu, delivered %llu of %llu (%llu lost, %llu truncated), %.1f/s\n",
+           (unsigned long long)total.sent, (unsigned long long)total.received,
+           (unsigned long long)expected, (unsigned long long)lost,
+           (unsigned long long)total.truncated, rate_out);
+    printf("latency us: p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+           (unsigned long long)latency[0], (unsigned long long)latency[1],
+           (unsigned long long)latency[2], (unsigned long long)latency[3],
+           (unsigned long long)latency[4]);
+    printf("cpu per sent message: %.2f us\n", cpu_us);
+  }
+  return SUCCESS;
+}
+
+/*
+ * psvis: process tree of a PID, from one of two backends producing nodes
+ * in preorder:
+ *  kernel - the psvis module stays loaded and serves trees through
+ *           /proc/psvis: write a PID, read back its tree (root only)
+ *  proc   - scans /proc/<pid>/stat in userspace, no module or root needed
+ * Nodes carry the resource usage of their process and the totals of their
+ * subtree, which both backends sum in one post-order pass.
+ */
+#define PSVIS_PROC "/proc/psvis"
+#define PSVIS_MAX_THREADS 16
+
+struct psvis_usage
+{
+  unsigned long long utime_ms, stime_ms, rss_kb;
+  int threads, files, procs;
+};
+
+struct psvis_node
+{
+  pid_t pid, ppid;
+  int depth;
+  long long start_ns; // since boot, like task_struct start_time
+  bool has_usage;
+  struct psvis_usage own, total;
+};
+
+typedef void (*psvis_emit_fn)(const struct psvis_node *node, void *ctx);
+
+static const char *psvis_metrics[] = {"cpu", "rss", "threads", "files", "procs", NULL};
+
+/*
+ * Where emitted nodes go: the tree, or the heaviest subtrees by a metric
+ */
+struct psvis_output
+{
+  struct out_buf *out;
+  bool usage; // print resource usage in the tree
+  int top;    // keep the top heaviest subtrees instead, 0 for the tree
+  int metric; // index in psvis_metrics
+  struct psvis_node *heap; // min-heap of the heaviest so far
+  int heap_count;
+  int prev_depth; // a node right below the previous one is its eldest child
+};
+
+static void psvis_add_usage(struct psvis_usage *sum, const struct psvis_usage *usage)
+{
+  sum->utime_ms += usage->utime_ms;
+  sum->stime_ms += usage->stime_ms;
+  sum->rss_kb += usage->rss_kb;
+  sum->threads += usage->threads;
+  sum->files += usage->files;
+  sum->procs += usage->procs;
+}
+
+static int psvis_format_usage(char *buf, size_t size, const struct psvis_node *node)
+{
+  const struct psvis_usage *own = &node->own, *total = &node->total;
+  return snprintf(buf, size,
+                  " utime=%llu stime=%llu rss=%llu threads=%d files=%d | subtree procs=%d "
+                  "utime=%llu stime=%llu rss=%llu threads=%d files=%d",
+                  own->utime_ms, own->stime_ms, own->rss_kb, own->threads, own->files,
+                  total->procs, total->utime_ms, total->stime_ms, total->rss_kb,
+                  total->threads, total->files);
+}
+
+/**
+ * Render a node the way traverse_proc_tree in psvis.c does
+ */
+static void psvis_emit_text(const struct psvis_node *node, void *ctx)
+{
+  struct psvis_output *output = ctx;
+  for (int i = 0; i < node->depth; i++)
+    out_write(output->out, "---", 3);
+  if (node->depth > 0)
+    out_write(output->out, ">", 1);
+  char line[512];
+  int len = snprintf(line, sizeof(line), "%d - PID: %d (start time: %lld)", node->depth,
+                     node->pid, node->start_ns);
+  if (output->usage && node->has_usage)
+    len += psvis_format_usage(line + len, sizeof(line) - len, node);
+  line[len++] = '\n';
+  out_write(output->out, line, len);
+}
+
+/*
+ * Graph renderers, streaming node by node: a preorder needs no buffering
+ * for edges, and the eldest child is the node right after its parent.
+ */
+static bool psvis_is_eldest(const struct psvis_node *node, struct psvis_output *output)
+{
+  bool eldest = node->depth > 0 && output->prev_depth == node->depth - 1;
+  output->prev_depth = node->depth;
+  return eldest;
+}
+
+static void psvis_emit_dot(const struct psvis_node *node, void *ctx)
+{
+  struct psvis_output *output = ctx;
+  bool eldest = psvis_is_eldest(node, output);
+  char line[1024];
+  int len = snprintf(line, sizeof(line),
+                     "  p%d [label=\"%d\", start_time=%lld, depth=%d, eldest=%s%s", node->pid,
+                     node->pid, node->start_ns, node->depth, eldest ? "true" : "false",
+                     eldest ? ", style=filled, fillcolor=lightblue" : "");
+  if (node->has_usage)
+  {
+    const struct psvis_usage *own = &node->own, *total = &node->total;
+    len += snprintf(line + len, sizeof(line) - len,
+                    ", utime=%llu, stime=%llu, rss=%llu, threads=%d, files=%d, "
+                    "subtree_procs=%d, subtree_utime=%llu, subtree_stime=%llu, "
+                    "subtree_rss=%llu, subtree_threads=%d, subtree_files=%d",
+                    own->utime_ms, own->stime_ms, own->rss_kb, own->threads, own->files,
+                    total->procs, total->utime_ms, total->stime_ms, total->rss_kb,
+                    total->threads, total->files);
+  }
+  len += snprintf(line + len, sizeof(line) - len, "];\n");
+  if (node->depth > 0)
+    len += snprintf(line + len, sizeof(line) - len, "  p%d -> p%d;\n", node->ppid, node->pid);
+  out_write(output->out, line, len);
+}
+
+static void psvis_emit_json(const struct psvis_node *node, void *ctx)
+{
+  struct psvis_output *output = ctx;
+  bool eldest = psvis_is_eldest(node, output);
+  char line[1024];
+  int len = snprintf(line, sizeof(line),
+                     "{\"pid\":%d,\"ppid\":%d,\"depth\":%d,\"start_time\":%lld,\"eldest\":%s",
+                     node->pid, node->ppid, node->depth, node->start_ns,
+                     eldest ? "true" : "false");
+  if (node->has_usage)
+  {
+    const struct psvis_usage *own = &node->own, *total = &node->total;
+    len += snprintf(line + len, sizeof(line) - len,
+                    ",\"usage\":{\"utime_ms\":%llu,\"stime_ms\":%llu,\"rss_kb\":%llu,"
+                    "\"threads\":%d,\"files\":%d},\"subtree\":{\"procs\":%d,"
+                    "\"utime_ms\":%llu,\"stime_ms\":%llu,\"rss_kb\":%llu,\"threads\":%d,"
+                    "\"files\":%d}",
+                    own->utime_ms, own->stime_ms, own->rss_kb, own->threads, own->files,
+                    total->procs, total->utime_ms, total->stime_ms, total->rss_kb,
+                    total->threads, total->files);
+  }
+  len += snprintf(line + len, sizeof(line) - len, "}\n");
+  out_write(output->out, line, len);
+}
+
+static unsigned long long psvis_metric(const struct psvis_node *node, int metric)
+{
+  switch (metric)
+  {
+  case 0:
+    return node->total.utime_ms + node->total.stime_ms;
+  case 1:
+    return node->total.rss_kb;
+  case 2:
+    return node->total.threads;
+  case 3:
+    return node->total.files;
+  default:
+    return node->total.procs;
+  }
+}
+
+static int psvis_compare_heaviest(const void *a, const void *b, void *arg)
+{
+  unsigned long long x = psvis_metric(a, *(int *)arg), y = psvis_metric(b, *(int *)arg);
+  if (x != y)
+    return x < y ? 1 : -1;
+  // the deeper of equal subtrees is closer to the problem
+  return ((const struct psvis_node *)b)->depth - ((const struct psvis_node *)a)->depth;
+}
+
+/**
+ * Keep the top heaviest subtrees in a min-heap, O(log top) per node
+ */
+static void psvis_emit_top(const struct psvis_node *node, void *ctx)
+{
+  struct psvis_output *output = ctx;
+  struct psvis_node *heap = output->heap;
+  unsigned long long weight = psvis_metric(node, output->metric);
+  int i;
+  if (output->heap_count < output->top)
+  {
+    // sift up
+    for (i = output->heap_count++;
+         i > 0 && psvis_metric(&heap[(i - 1) / 2], output->metric) > weight; i = (i - 1) / 2)
+      heap[i] = heap[(i - 1) / 2];
+    heap[i] = *node;
+    return;
+  }
+  if (weight <= psvis_metric(&heap[0], output->metric))
+    return;
+  // replace the lightest, sift down
+  for (i = 0;;)
+  {
+    int child = 2 * i + 1;
+    if (child >= output->heap_count)
+      break;
+    if (child + 1 < output->heap_count && psvis_metric(&heap[child + 1], output->metric) <
+                                              psvis_metric(&heap[child], output->metric))
+      child++;
+    if (psvis_metric(&heap[child], output->metric) >= weight)
+      break;
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = *node;
+}
+
+static void psvis_write_top(struct psvis_output *output)
+{
+  qsort_r(output->heap, output->heap_count, sizeof(struct psvis_node), psvis_compare_heaviest,
+          &output->metric);
+  for (int i = 0; i < output->heap_count; i++)
+  {
+    const struct psvis_node *node = &output->heap[i];
+    char line[512];
+    int len = snprintf(line, sizeof(line), "%d. PID: %d (depth %d)", i + 1, node->pid,
+                       node->depth);
+    len += psvis_format_usage(line + len, sizeof(line) - len, node);
+    line[len++] = '\n';
+    out_write(output->out, line, len);
+  }
+}
+
+/**
+ * Parse one line of /proc/psvis into a node
+ * @return false for other lines, like the error for a missing PID
+ */
+static bool psvis_parse_line(const char *line, struct psvis_node *node)
+{
+  while (*line == '-' || *line == '>')
+    line++;
+  if (sscanf(line, "%d - PID: %d (start time: %lld)", &node->depth, &node->pid,
+             &node->start_ns) != 3)
+    return false;
+  struct psvis_usage *own = &node->own, *total = &node->total;
+  const char *tail = strchr(line, ')');
+  own->procs = 1;
+  node->has_usage =
+      sscanf(tail + 1,
+             " utime=%llu stime=%llu rss=%llu threads=%d files=%d | subtree procs=%d "
+             "utime=%llu stime=%llu rss=%llu threads=%d files=%d",
+             &own->utime_ms, &own->stime_ms, &own->rss_kb, &own->threads, &own->files,
+             &total->procs, &total->utime_ms, &total->stime_ms, &total->rss_kb,
+             &total->threads, &total->files) == 11;
+  return true;
+}
+
+/**
+ * @return 0, 1 when root does not exist, -1 on error
+ */
+static int psvis_kernel(pid_t root, bool load, psvis_emit_fn emit, void *ctx)
+{
+  int fd = open(PSVIS_PROC, O_RDWR | O_CLOEXEC);
+  if (fd == -1 && errno == ENOENT && load)
+  {
+    // first use: load the module, it stays loaded for the next calls
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      job_default_signals();
+      char *insmod[] = {"sudo", "insmod", "psvis.ko", NULL};
+      execvp(insmod[0], insmod);
+      _exit(127);
+    }
+    if (pid > 0)
+      waitpid(pid, NULL, 0);
+    fd = open(PSVIS_PROC, O_RDWR | O_CLOEXEC);
+  }
+  if (fd == -1)
+  {
+    printf("-%s: psvis: %s: %s\n", sysname, PSVIS_PROC, strerror(errno));
+    return -1;
+  }
+  char pid_arg[32];
+  int len = snprintf(pid_arg, sizeof(pid_arg), "%d", root);
+  if (write(fd, pid_arg, len) == -1)
+  {
+    printf("-%s: psvis: %d: %s\n", sysname, root, strerror(errno));
+    close(fd);
+    return -1;
+  }
+
+  // stream the tree as the module produces it, a line at a time
+  pid_t *parents = NULL; // PID on the path from the root per depth
+  int parents_size = 0;
+  char buf[OUT_BUF_SIZE];
+  size_t have = 0;
+  ssize_t n;
+  int nodes = 0;
+  bool missing = false;
+  while ((n = read(fd, buf + have, sizeof(buf) - 1 - have)) > 0)
+  {
+    have += n;
+    char *line = buf, *end;
+    while ((end = memchr(line, '\n', buf + have - line)) != NULL)
+    {
+      *end = 0;
+      struct psvis_node node;
+      if (psvis_parse_line(line, &node) && node.depth >= 0 && node.depth <= parents_size)
+      {
+        if (node.depth == parents_size)
+          parents = realloc(parents, sizeof(pid_t) * (parents_size = 2 * parents_size + 64));
+        parents[node.depth] = node.pid;
+        node.ppid = node.depth > 0 ? parents[node.depth - 1] : 0;
+        emit(&node, ctx);
+        nodes++;
+      }
+      else if (strncmp(line, "Given PID:", 10) == 0)
+        missing = true;
+      else if (*line)
+        printf("psvis: %s\n", line);
+      line = end + 1;
+    }
+    have -= line - buf;
+    if (have == sizeof(buf) - 1) // no newline in a whole buffer
+      have = 0;
+    memmove(buf, line, have);
+  }
+  free(parents);
+  close(fd);
+  return missing ? 1 : 0;
+}
+
+/*
+ * proc backend. /proc is listed with getdents64 and the stat files are
+ * read by a few threads, each taking a slice of the PIDs. A hash map from
+ * PID to slot and a children index (counting sort by parent) make the
+ * tree walk linear. Slot count is a virtual PID 0, the parent of processes
+ * whose parent is not in /proc, like the kernel's idle task.
+ */
+struct psvis_proc
+{
+  pid_t pid, ppid; // pid 0 when the process exited during the scan
+  long long start_ns;
+  struct psvis_usage own, total;
+};
+
+struct psvis_table
+{
+  struct psvis_proc *procs;
+  int count;
+  int proc_fd;
+  bool usage; // also read resource usage
+  int *slots; // pid hash, open addressing, index + 1
+  unsigned mask;
+  int *parent; // slot of the parent, -1 for exited processes
+  int *child_start, *children;
+};
+
+struct psvis_scan_slice
+{
+  struct psvis_table *table;
+  int from, to;
+};
+
+struct linux_dirent64
+{
+  ino64_t d_ino;
+  off64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+/**
+ * Count the open files of a process, 0 when not allowed to look
+ */
+static int psvis_count_files(int proc_fd, pid_t pid)
+{
+  char path[32], buf[4096] __attribute__((aligned(8)));
+  snprintf(path, sizeof(path), "%d/fd", pid);
+  int fd = openat(proc_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  int files = 0;
+  long n;
+  while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0)
+    for (long off = 0; off < n;)
+    {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + off);
+      off += entry->d_reclen;
+      if (entry->d_name[0] != '.')
+        files++;
+    }
+  close(fd);
+  return files;
+}
+
+/**
+ * Read ppid, start time and usage out of /proc/<pid>/stat
+ */
+static bool psvis_read_stat(int proc_fd, bool usage, struct psvis_proc *proc)
+{
+  static long ns_per_tick, page_kb;
+  if (ns_per_tick == 0)
+  {
+    ns_per_tick = 1000000000L / sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  }
+  char path[32], buf[1024];
+  snprintf(path, sizeof(path), "%d/stat", proc->pid);
+  int fd = openat(proc_fd, path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  ssize_t n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return false;
+  buf[n] = 0;
+  // the command name may hold spaces and parentheses, fields follow the last ')'
+  char *p = strrchr(buf, ')');
+  if (p == NULL)
+    return false;
+  unsigned long long field[22];
+  int count = 0;
+  for (p += 2; *p && count < 22; count++) // from field 3, state, on
+  {
+    field[count] = strtoull(p, &p, 10);
+    while (*p == ' ')
+      p++;
+    if (count == 0) // state is a letter
+      while (*p && *p != ' ')
+        p++;
+  }
+  if (count < 22)
+    return false;
+  proc->ppid = field[1];
+  proc->start_ns = (long long)field[19] * ns_per_tick;
+  memset(&proc->own, 0, sizeof(proc->own));
+  proc->own.procs = 1;
+  if (usage)
+  {
+    proc->own.utime_ms = field[11] * ns_per_tick / 1000000;
+    proc->own.stime_ms = field[12] * ns_per_tick / 1000000;
+    proc->own.threads = field[17];
+    proc->own.rss_kb = field[21] * page_kb;
+    proc->own.files = psvis_count_files(proc_fd, proc->pid);
+  }
+  return true;
+}
+
+static void *psvis_scan_thread(void *arg)
+{
+  struct psvis_scan_slice *slice = arg;
+  for (int i = slice->from; i < slice->to; i++)
+  {
+    struct psvis_proc *proc = &slice->table->procs[i];
+    if (!psvis_read_stat(slice->table->proc_fd, slice->table->usage, proc))
+      proc->pid = 0;
+  }
+  return NULL;
+}
+
+static int psvis_lookup(struct psvis_table *table, pid_t pid)
+{
+  for (unsigned h = (unsigned)pid * 2654435761u & table->mask; table->slots[h];
+       h = (h + 1) & table->mask)
+    if (table->procs[table->slots[h] - 1].pid == pid)
+      return table->slots[h] - 1;
+  return -1;
+}
+
+static int psvis_compare_children(const void *a, const void *b, void *arg)
+{
+  const struct psvis_proc *procs = arg;
+  const struct psvis_proc *x = &procs[*(const int *)a], *y = &procs[*(const int *)b];
+  if (x->start_ns != y->start_ns)
+    return x->start_ns < y->start_ns ? -1 : 1;
+  return x->pid - y->pid;
+}
+
+/**
+ * Take a snapshot of every process
+ * @return 0, -1 on error
+ */
+static int psvis_scan(struct psvis_table *table, bool usage, int *threads_used)
+{
+  memset(table, 0, sizeof(*table));
+  table->usage = usage;
+  table->proc_fd = open("/proc", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (table->proc_fd == -1)
+    return -1;
+  int capacity = 1024;
+  table->procs = malloc(capacity * sizeof(struct psvis_proc));
+  char buf[1 << 16] __attribute__((aligned(8)));
+  long n;
+  while ((n = syscall(SYS_getdents64, table->proc_fd, buf, sizeof(buf))) > 0)
+  {
+    for (long off = 0; off < n;)
+    {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)(buf + off);
+      off += entry->d_reclen;
+      if (entry->d_name[0] < '1' || entry->d_name[0] > '9')
+        continue;
+      if (table->count + 1 == capacity) // one left for the virtual root
+      {
+        capacity *= 2;
+        table->procs = realloc(table->procs, capacity * sizeof(struct psvis_proc));
+      }
+      table->procs[table->count++].pid = atoi(entry->d_name);
+    }
+  }
+
+  // a slice per thread, threads only pay off for large systems
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int threads = table->count / 512 + 1;
+  if (threads > cpus)
+    threads = cpus > 0 ? cpus : 1;
+  if (threads > PSVIS_MAX_THREADS)
+    threads = PSVIS_MAX_THREADS;
+  pthread_t tids[PSVIS_MAX_THREADS];
+  struct psvis_scan_slice slices[PSVIS_MAX_THREADS];
+  for (int t = 0; t < threads; t++)
+  {
+    slices[t] = (struct psvis_scan_slice){table, table->count * t / threads,
+                                          table->count * (t + 1) / threads};
+    if (t > 0)
+      pthread_create(&tids[t], NULL, psvis_scan_thread, &slices[t]);
+  }
+  psvis_scan_thread(&slices[0]);
+  for (int t = 1; t < threads; t++)
+    pthread_join(tids[t], NULL);
+  *threads_used = threads;
+  memset(&table->procs[table->count], 0, sizeof(struct psvis_proc));
+
+  // pid -> slot, sized for a load factor of at most a half
+  unsigned size = 16;
+  while (size < 2u * table->count)
+    size *= 2;
+  table->mask = size - 1;
+  table->slots = calloc(size, sizeof(int));
+  for (int i = 0; i < table->count; i++)
+  {
+    if (table->procs[i].pid == 0)
+      continue;
+    unsigned h = (unsigned)table->procs[i].pid * 2654435761u & table->mask;
+    while (table->slots[h])
+      h = (h + 1) & table->mask;
+    table->slots[h] = i + 1;
+  }
+
+  // children grouped by parent slot
+  table->child_start = calloc(table->count + 3, sizeof(int));
+  table->children = malloc((table->count + 1) * sizeof(int));
+  int *parent = table->parent = malloc((table->count + 1) * sizeof(int));
+  parent[table->count] = -1;
+  for (int i = 0; i < table->count; i++)
+  {
+    parent[i] = -1;
+    if (table->procs[i].pid == 0)
+      continue;
+    parent[i] = psvis_lookup(table, table->procs[i].ppid);
+    if (parent[i] == -1)
+      parent[i] = table->count;
+    table->child_start[parent[i] + 2]++;
+  }
+  for (int i = 2; i <= table->count + 2; i++)
+    table->child_start[i] += table->child_start[i - 1];
+  for (int i = 0; i < table->count; i++)
+    if (parent[i] >= 0)
+      table->children[table->child_start[parent[i] + 1]++] = i;
+  for (int i = 0; i <= table->count; i++) // oldest first, as in the kernel's lists
+    qsort_r(table->children + table->child_start[i],
+            table->child_start[i + 1] - table->child_start[i], sizeof(int),
+            psvis_compare_children, table->procs);
+  return 0;
+}
+
+static void psvis_table_free(struct psvis_table *table)
+{
+  if (table->proc_fd != -1)
+    close(table->proc_fd);
+  free(table->procs);
+  free(table->slots);
+  free(table->parent);
+  free(table->child_start);
+  free(table->children);
+}
+
+/**
+ * Sum subtree usage: children come after their parent in preorder, so a
+ * single pass over the preorder in reverse is a post-order pass
+ */
+static void psvis_sum_subtrees(struct psvis_table *table)
+{
+  int *order = malloc((table->count + 1) * sizeof(int));
+  int *stack = malloc((table->count + 1) * sizeof(int));
+  int count = 0, top = 0;
+  stack[top++] = table->count;
+  while (top > 0)
+  {
+    int i = stack[--top];
+    order[count++] = i;
+    table->procs[i].total = table->procs[i].own;
+    for (int c = table->child_start[i]; c < table->child_start[i + 1]; c++)
+      stack[top++] = table->children[c];
+  }
+  for (int k = count - 1; k > 0; k--) // order[0] is the root
+  {
+    int i = order[k];
+    psvis_add_usage(&table->procs[table->parent[i]].total, &table->procs[i].total);
+  }
+  free(stack);
+  free(order);
+}
+
+/**
+ * Walk the snapshot from root in preorder, with an explicit stack. Root 0
+ * is the whole system.
+ */
+static int psvis_walk(struct psvis_table *table, pid_t root, psvis_emit_fn emit, void *ctx)
+{
+  int start = root == 0 ? table->count : psvis_lookup(table, root);
+  if (start == -1)
+    return -1;
+  struct psvis_node node;
+  int *stack = malloc((table->count + 1) * sizeof(int));
+  int *depths = malloc((table->count + 1) * sizeof(int));
+  int top = 0;
+  stack[top] = start;
+  depths[top++] = 0;
+  while (top > 0)
+  {
+    int i = stack[--top];
+    const struct psvis_proc *proc = &table->procs[i];
+    node.pid = proc->pid;
+    node.ppid = proc->ppid;
+    node.depth = depths[top];
+    node.start_ns = proc->start_ns;
+    node.has_usage = table->usage;
+    node.own = proc->own;
+    node.total = proc->total;
+    emit(&node, ctx);
+    // pushed youngest first, so the eldest comes out first
+    for (int c = table->child_start[i + 1] - 1; c >= table->child_start[i]; c--)
+    {
+      stack[top] = table->children[c];
+      depths[top++] = node.depth + 1;
     }
-    dup2(in, STDIN_FILENO); // copy file to stdin
-    close(in);
   }
+  free(stack);
+  free(depths);
+  return 0;
+}
+
+/**
+ * @return 0, 1 when root does not exist, -1 on error
+ */
+static int psvis_userspace(pid_t root, bool usage, bool verbose, psvis_emit_fn emit,
+                           void *ctx)
+{
+  struct timespec begin, end;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  struct psvis_table table;
+  int threads = 1;
+  if (psvis_scan(&table, usage, &threads) == -1)
+  {
+    printf("-%s: psvis: /proc: %s\n", sysname, strerror(errno));
+    return -1;
+  }
+  if (usage)
+    psvis_sum_subtrees(&table);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  int found = psvis_walk(&table, root, emit, ctx) == -1 ? 1 : 0;
+  if (verbose)
+    printf("psvis: scanned %d processes in %.2f ms with %d thread(s)\n", table.count,
+           (end.tv_sec - begin.tv_sec) * 1e3 + (end.tv_nsec - begin.tv_nsec) / 1e6,
+           threads);
+  psvis_table_free(&table);
+  return found;
+}
+
+/*
+ * psvis watch mode: a loop timer takes a snapshot every interval and
+ * appends only what changed since the previous one to the file. Snapshots
+ * are node arrays with a PID hash, so a diff costs a lookup per process.
+ */
+struct psvis_snapshot
+{
+  struct psvis_node *nodes;
+  int count, capacity;
+  int *slots; // pid hash, open addressing, index + 1
+  unsigned mask;
+};
+
+static struct
+{
+  bool active;
+  int timer;
+  pid_t root;
+  bool kernel;
+  struct out_buf *out;
+  struct psvis_snapshot last;
+} psvis_watch;
+
+static void psvis_emit_snapshot(const struct psvis_node *node, void *ctx)
+{
+  struct psvis_snapshot *snap = ctx;
+  if (snap->count == snap->capacity)
+  {
+    snap->capacity = snap->capacity ? 2 * snap->capacity : 256;
+    snap->nodes = realloc(snap->nodes, snap->capacity * sizeof(struct psvis_node));
+  }
+  snap->nodes[snap->count++] = *node;
+}
+
+static void psvis_snapshot_index(struct psvis_snapshot *snap)
+{
+  unsigned size = 16;
+  while (size < 2u * snap->count)
+    size *= 2;
+  snap->mask = size - 1;
+  snap->slots = calloc(size, sizeof(int));
+  for (int i = 0; i < snap->count; i++)
+  {
+    unsigned h = (unsigned)snap->nodes[i].pid * 2654435761u & snap->mask;
+    while (snap->slots[h])
+      h = (h + 1) & snap->mask;
+    snap->slots[h] = i + 1;
+  }
+}
+
+static struct psvis_node *psvis_snapshot_find(struct psvis_snapshot *snap, pid_t pid)
+{
+  if (snap->slots == NULL)
+    return NULL;
+  for (unsigned h = (unsigned)pid * 2654435761u & snap->mask; snap->slots[h];
+       h = (h + 1) & snap->mask)
+    if (snap->nodes[snap->slots[h] - 1].pid == pid)
+      return &snap->nodes[snap->slots[h] - 1];
+  return NULL;
+}
+
+static void psvis_snapshot_free(struct psvis_snapshot *snap)
+{
+  free(snap->nodes);
+  free(snap->slots);
+  memset(snap, 0, sizeof(*snap));
+}
+
+static int psvis_take_snapshot(struct psvis_snapshot *snap)
+{
+  memset(snap, 0, sizeof(*snap));
+  if (psvis_watch.kernel)
+    psvis_kernel(psvis_watch.root, false, psvis_emit_snapshot, snap);
+  else
+    psvis_userspace(psvis_watch.root, true, false, psvis_emit_snapshot, snap);
+  psvis_snapshot_index(snap);
+  return snap->count;
+}
+
+/**
+ * Append what changed between two snapshots, nothing when nothing did
+ */
+static void psvis_write_diff(struct psvis_snapshot *old, struct psvis_snapshot *now,
+                             struct out_buf *out)
+{
+  char line[512];
+  int len, spawned = 0, exited = 0, changed = 0;
+  size_t mark = out->len;
+  time_t t = time(NULL);
+  struct tm tm;
+  len = strftime(line, sizeof(line), "# %H:%M:%S\n", localtime_r(&t, &tm));
+  out_write(out, line, len);
+  for (int i = 0; i < now->count; i++)
+  {
+    struct psvis_node *node = &now->nodes[i], *was = psvis_snapshot_find(old, node->pid);
+    if (was && was->start_ns != node->start_ns) // the PID was reused
+    {
+      len = snprintf(line, sizeof(line), "- PID: %d\n", was->pid);
+      out_write(out, line, len);
+      exited++;
+      was = NULL;
+    }
+    if (was == NULL)
+    {
+      len = snprintf(line, sizeof(line), "+ PID: %d (parent %d, start time: %lld)\n",
+                     node->pid, node->ppid, node->start_ns);
+      spawned++;
+    }
+    else if (was->ppid != node->ppid)
+    {
+      len = snprintf(line, sizeof(line), "^ PID: %d reparented %d -> %d\n", node->pid,
+                     was->ppid, node->ppid);
+      changed++;
+    }
+    else
+      len = 0;
+    out_write(out, line, len);
+
+    if (was && node->has_usage &&
+        memcmp(&was->own, &node->own, sizeof(struct psvis_usage)) != 0)
+    {
+      len = snprintf(line, sizeof(line),
+                     "~ PID: %d utime=%+lld stime=%+lld rss=%+lld threads=%+d files=%+d\n",
+                     node->pid, (long long)(node->own.utime_ms - was->own.utime_ms),
+                     (long long)(node->own.stime_ms - was->own.stime_ms),
+                     (long long)(node->own.rss_kb - was->own.rss_kb),
+                     node->own.threads - was->own.threads, node->own.files - was->own.files);
+      out_write(out, line, len);
+      changed++;
+    }
+  }
+  for (int i = 0; i < old->count; i++)
+  {
+    struct psvis_node *was = &old->nodes[i], *node = psvis_snapshot_find(now, was->pid);
+    if (node == NULL)
+    {
+      len = snprintf(line, sizeof(line), "- PID: %d\n", was->pid);
+      out_write(out, line, len);
+      exited++;
+    }
+  }
+  if (spawned + exited + changed == 0 && out->len > mark)
+  {
+    out->len = mark; // drop the time line
+    return;
+  }
+  len = snprintf(line, sizeof(line), "# %d spawned, %d exited, %d changed\n", spawned, exited,
+                 changed);
+  out_write(out, line, len);
+}
+
+static void psvis_unwatch()
+{
+  if (!psvis_watch.active)
+    return;
+  loop_cancel_timer(psvis_watch.timer);
+  out_flush(psvis_watch.out);
+  close(psvis_watch.out->fd);
+  free(psvis_watch.out);
+  psvis_snapshot_free(&psvis_watch.last);
+  psvis_watch.active = false;
+}
+
+bool psvis_watching()
+{
+  return psvis_watch.active;
+}
+
+static void psvis_watch_tick(int timer, void *data)
+{
+  struct psvis_snapshot now;
+  if (psvis_take_snapshot(&now) == 0)
+  {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "# PID %d exited, watch stopped\n",
+                       psvis_watch.root);
+    out_write(psvis_watch.out, line, len);
+    psvis_snapshot_free(&now);
+    psvis_unwatch();
+    return;
+  }
+  psvis_write_diff(&psvis_watch.last, &now, psvis_watch.out);
+  out_flush(psvis_watch.out);
+  psvis_snapshot_free(&psvis_watch.last);
+  psvis_watch.last = now;
+}
+
+/**
+ * Start watching: write the whole tree once, then diffs every interval
+ */
+static int psvis_start_watch(pid_t root, bool kernel, double interval,
+                             struct psvis_output *output)
+{
+  psvis_unwatch();
+  psvis_watch.root = root;
+  psvis_watch.kernel = kernel;
+  if (kernel && access(PSVIS_PROC, F_OK) == -1)
+    psvis_kernel(root, true, psvis_emit_snapshot, &psvis_watch.last); // loads it
+  psvis_snapshot_free(&psvis_watch.last);
+  if (psvis_take_snapshot(&psvis_watch.last) == 0)
+  {
+    printf("Given PID: %d doesnt exist\n", root);
+    psvis_snapshot_free(&psvis_watch.last);
+    return -1;
+  }
+  for (int i = 0; i < psvis_watch.last.count; i++)
+    psvis_emit_text(&psvis_watch.last.nodes[i], output);
+  out_flush(output->out);
+  psvis_watch.out = output->out;
+  psvis_watch.timer = loop_add_timer(interval * 1000, interval * 1000, psvis_watch_tick, NULL);
+  psvis_watch.active = true;
+  return 0;
+}
+
+/**
+ * psvis [-b kernel|proc] [-v] [-r] [-f text|dot|json] [-k count [-s metric]]
+ * <pid> <file>: write the process tree of pid, or of the whole system for
+ * 0, to file, with resource usage for -r. -f picks indented text, Graphviz
+ * DOT or one JSON object per line. -k lists the count heaviest subtrees by cpu
+ * time, rss, threads, files or procs instead. Without -b the module is
+ * used when loaded, /proc otherwise.
+ * With --watch <seconds> the tree is written once, then every interval the
+ * processes spawned, exited, reparented and their usage changes are
+ * appended, in the background, until psvis --unwatch.
+ */
+int psvis(struct command_t *command)
+{
+  const char *backend = NULL, *metric = "cpu", *format = "text", *args[2];
+  struct psvis_output output = {0};
+  bool verbose = false;
+  double watch = 0;
+  int argc = 0;
+  if (command->arg_count == 1 && strcmp(command->args[0], "--unwatch") == 0)
+  {
+    psvis_unwatch();
+    return SUCCESS;
+  }
+  for (int i = 0; i < command->arg_count; i++)
+  {
+    const char *arg = command->args[i];
+    bool has_value = i + 1 < command->arg_count;
+    if (strcmp(arg, "--watch") == 0 && has_value)
+    {
+      watch = atof(command->args[++i]);
+      if (watch < 0.01)
+        watch = -1; // rejected below
+    }
+    else if (strcmp(arg, "-b") == 0 && has_value)
+      backend = command->args[++i];
+    else if (strcmp(arg, "-k") == 0 && has_value)
+      output.top = atoi(command->args[++i]);
+    else if (strcmp(arg, "-s") == 0 && has_value)
+      metric = command->args[++i];
+    else if (strcmp(arg, "-f") == 0 && has_value)
+      format = command->args[++i];
+    else if (strcmp(arg, "-v") == 0)
+      verbose = true;
+    else if (strcmp(arg, "-r") == 0)
+      output.usage = true;
+    else if (argc < 2)
+      args[argc++] = arg;
+  }
+  output.metric = 0;
+  while (psvis_metrics[output.metric] && strcmp(psvis_metrics[output.metric], metric))
+    output.metric++;
+  if (argc != 2 || (backend && strcmp(backend, "kernel") && strcmp(backend, "proc")) ||
+      psvis_metrics[output.metric] == NULL || output.top < 0 || watch < 0 ||
+      (watch > 0 && output.top > 0) ||
+      (strcmp(format, "text") && strcmp(format, "dot") && strcmp(format, "json")) ||
+      (strcmp(format, "text") && (watch > 0 || output.top > 0)))
+  {
+    printf("-%s: psvis: usage: psvis [-b kernel|proc] [-v] [-r] [-f text|dot|json | "
+           "-k count [-s cpu|rss|threads|files|procs] | --watch seconds] <pid> <file>\n",
+           sysname);
+    return UNKNOWN;
+  }
+  if (backend == NULL) // only root may write a PID to the module
+    backend = access(PSVIS_PROC, R_OK | W_OK) == 0 ? "kernel" : "proc";
+
+  int fd = open(args[1], O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd == -1)
+  {
+    printf("-%s: psvis: %s: %s\n", sysname, args[1], strerror(errno));
+    return UNKNOWN;
+  }
+  output.out = malloc(sizeof(struct out_buf));
+  output.out->fd = fd;
+  output.out->len = 0;
+  if (watch > 0)
+  {
+    if (psvis_start_watch(atoi(args[0]), strcmp(backend, "kernel") == 0, watch, &output) == -1)
+    {
+      free(output.out);
+      close(fd);
+    }
+    return SUCCESS;
+  }
+  psvis_emit_fn emit = psvis_emit_text;
+  output.prev_depth = -1;
+  if (output.top > 0)
+  {
+    output.heap = malloc(output.top * sizeof(struct psvis_node));
+    emit = psvis_emit_top;
+  }
+  else if (strcmp(format, "dot") == 0)
+  {
+    emit = psvis_emit_dot;
+    out_write(output.out, "digraph psvis {\n", 16);
+  }
+  else if (strcmp(format, "json") == 0)
+    emit = psvis_emit_json;
+  pid_t root = atoi(args[0]);
+  bool usage = output.usage || output.top > 0;
+  int found = strcmp(backend, "kernel") == 0
+                  ? psvis_kernel(root, true, emit, &output)
+                  : psvis_userspace(root, usage, verbose, emit, &output);
+  if (found == 1)
+    printf("Given PID: %d doesnt exist\n", root);
+  if (output.top > 0)
+    psvis_write_top(&output);
+  if (emit == psvis_emit_dot)
+    out_write(output.out, "}\n", 2);
+  out_flush(output.out);
+  free(output.out);
+  free(output.heap);
+  close(fd);
+  return SUCCESS;
+}
+
+int motivation_prompt(int cycle_no, int max_cycle)
+{
+  if (cycle_no == 1)
+  {
+    printf("Good luck working, keep it zen ⊹╰(⌣ʟ⌣)╯⊹\n");
+  }
+  if (cycle_no == max_cycle)
+  {
+    printf("Last cycle! You got this ᕙ(⌣◡⌣”)ᕗ\n");
+  }
+  if (cycle_no != 1 && cycle_no != max_cycle)
+    printf("\n");
+  return 0;
+}
+
+/*
+ * Pomodoro sessions run on event loop timers, one timerfd each, and
+ * announce themselves over the prompt, so the shell stays usable and any
+ * number of sessions can overlap.
+ */
+enum pomodoro_phases
+{
+  POMODORO_STUDY = 0,
+  POMODORO_LAST_FIVE = 1, // last five minutes of the study period
+  POMODORO_BREAK = 2,
+};
+
+static const char *pomodoro_phase_names[] = {"study", "study", "break"};
+
+struct pomodoro_session
+{
+  int id;
+  int timer;
+  int cycle, cycles;
+  double study_min, break_min;
+  enum pomodoro_phases phase;
+  struct pomodoro_session *next;
+};
+
+static struct
+{
+  struct pomodoro_session *sessions; // newest first
+  int next_id;
+} pomodoros = {NULL, 1};
+
+static void pomodoro_tick(int timer, void *data);
+
+static void pomodoro_arm(struct pomodoro_session *session, enum pomodoro_phases phase,
+                         double minutes)
+{
+  session->phase = phase;
+  session->timer = loop_add_timer(minutes * 60000, 0, pomodoro_tick, session);
+}
+
+static void pomodoro_remove(struct pomodoro_session *session)
+{
+  struct pomodoro_session **link = &pomodoros.sessions;
+  while (*link != session)
+    link = &(*link)->next;
+  *link = session->next;
+  if (session->timer != -1)
+    loop_cancel_timer(session->timer);
+  free(session);
+}
+
+static void pomodoro_start_cycle(struct pomodoro_session *session)
+{
+  session->cycle++;
+  printf("\aEntering pomodoro cycle %d (session %d) ... ", session->cycle, session->id);
+  motivation_prompt(session->cycle, session->cycles);
+  if (session->study_min > 5)
+    pomodoro_arm(session, POMODORO_LAST_FIVE, session->study_min - 5);
+  else
+    pomodoro_arm(session, POMODORO_STUDY, session->study_min);
+}
+
+/**
+ * Phase change of a session, its one shot timer is already gone
+ */
+static void pomodoro_tick(int timer, void *data)
+{
+  struct pomodoro_session *session = data;
+  session->timer = -1;
+  prompt_interrupt_begin();
+  if (session->phase == POMODORO_LAST_FIVE)
+  {
+    printf("Last five minutes... little goes a long way!\n");
+    pomodoro_arm(session, POMODORO_STUDY, 5);
+  }
+  else if (session->phase == POMODORO_BREAK)
+    pomodoro_start_cycle(session);
+  else if (session->cycle == session->cycles)
+  {
+    printf("Great Job! You completed ALL your cycles ( ⌒o⌒)人(⌒-⌒\n");
+    pomodoro_remove(session);
+  }
+  else
+  {
+    printf("Nice... You completed %d cycle(s) \n", session->cycle);
+    printf("\aNow its time for a %g minute break...\n", session->break_min);
+    pomodoro_arm(session, POMODORO_BREAK, session->break_min);
+  }
+  prompt_interrupt_end();
+}
+
+bool pomodoro_active()
+{
+  return pomodoros.sessions != NULL;
+}
+
+static void pomodoro_list()
+{
+  for (struct pomodoro_session *session = pomodoros.sessions; session;
+       session = session->next)
+  {
+    struct itimerspec left = {0};
+    if (session->timer != -1)
+      timerfd_gettime(session->timer, &left);
+    long seconds = left.it_value.tv_sec + (left.it_value.tv_nsec > 0);
+    if (session->phase == POMODORO_LAST_FIVE)
+      seconds += 5 * 60;
+    printf("[%d] cycle %d/%d, %s, %ld:%02ld left\n", session->id, session->cycle,
+           session->cycles, pomodoro_phase_names[session->phase], seconds / 60, seconds % 60);
+  }
+}
+
+/**
+ * pomodoro cycles study_min break_min starts a session in the background,
+ * pomodoro list shows the running ones, pomodoro cancel id stops one
+ * @return SUCCESS or UNKNOWN on bad usage
+ */
+int pomodoro(struct command_t *command)
+{
+  if (command->arg_count == 1 && strcmp(command->args[0], "list") == 0)
+  {
+    pomodoro_list();
+    return SUCCESS;
+  }
+  if (command->arg_count == 2 && strcmp(command->args[0], "cancel") == 0)
+  {
+    int id = atoi(command->args[1]);
+    for (struct pomodoro_session *session = pomodoros.sessions; session;
+         session = session->next)
+      if (session->id == id)
+      {
+        pomodoro_remove(session);
+        printf("Pomodoro session %d cancelled\n", id);
+        return SUCCESS;
+      }
+    printf("-%s: pomodoro: %s: no such session\n", sysname, command->args[1]);
+    return UNKNOWN;
+  }
+
+  int cycles = command->arg_count == 3 ? atoi(command->args[0]) : 0;
+  double study_min = cycles > 0 ? atof(command->args[1]) : 0;
+  double break_min = cycles > 0 ? atof(command->args[2]) : -1;
+  if (cycles <= 0 || study_min <= 0 || break_min < 0)
+  {
+    printf("-%s: pomodoro: usage: pomodoro cycles study_minutes break_minutes | list | "
+           "cancel id\n",
+           sysname);
+    return UNKNOWN;
+  }
+  struct pomodoro_session *session = calloc(1, sizeof(struct pomodoro_session));
+  session->id = pomodoros.next_id++;
+  session->cycles = cycles;
+  session->study_min = study_min;
+  session->break_min = break_min;
+  session->next = pomodoros.sessions;
+  pomodoros.sessions = session;
+  pomodoro_start_cycle(session);
+  if (session->timer == -1)
+  {
+    printf("-%s: pomodoro: %s\n", sysname, strerror(errno));
+    pomodoro_remove(session);
+    return UNKNOWN;
+  }
+  return SUCCESS;
+}
+
+/*
+ * Periodic commands, run by a hierarchical timer wheel with one second
+ * ticks. Level L has 64 slots of 64^L seconds, entries sit in the slot of
+ * their expiry and move down a level when their slot comes up, so insert
+ * and expiry are O(1). Only one loop timer is armed, for the next tick that
+ * has work, so an idle schedule costs no wakeups.
+ *
+ * Commands run through /bin/sh in their own process group with their
+ * output discarded, like cron. The schedule is kept in $SCHEDFILE or
+ * ~/.shellax_sched. Every interactive shell keeps a wheel of it, reloaded
+ * through inotify when another shell changes the file, but only the shell
+ * holding the flock on <file>.run runs the commands; the others take over
+ * at their next due entry once it exits. Changes re-read the file under a
+ * flock on <file>.lock, so concurrent adds keep each other's entries and
+ * ids.
+ */
+#define SCHED_SLOTS (1 << SCHED_WHEEL_BITS)
+
+struct sched_entry
+{
+  int id;
+  long interval; // seconds
+  long expires;  // epoch second of the next run
+  char *command;
+  struct sched_entry *prev, *next; // wheel slot
+};
+
+static struct
+{
+  struct sched_entry *slots[SCHED_WHEEL_LEVELS][SCHED_SLOTS];
+  uint64_t occupied[SCHED_WHEEL_LEVELS]; // bit per non empty slot
+  long now; // last tick processed, epoch seconds
+  int timer; // loop timer for the next tick with work, -1 when idle
+  int count, next_id;
+  char path[4096];
+  int run_fd;   // flock held by the shell running the entries, -1 for the others
+  int watch_fd; // inotify on the directory of the schedule file
+} sched = {.timer = -1, .next_id = 1, .run_fd = -1, .watch_fd = -1};
+
+static void sched_link(struct sched_entry *entry)
+{
+  long delta = entry->expires - sched.now;
+  int level = 0;
+  while (level < SCHED_WHEEL_LEVELS - 1 && delta >= 1L << (SCHED_WHEEL_BITS * (level + 1)))
+    level++;
+  long at = entry->expires;
+  if (at < sched.now)
+    at = sched.now; // due during the tick being processed
+  long range = 1L << (SCHED_WHEEL_BITS * SCHED_WHEEL_LEVELS);
+  if (delta >= range) // cascades again when the top slot comes up
+    at = sched.now + range - 1;
+  int slot = (at >> (SCHED_WHEEL_BITS * level)) & (SCHED_SLOTS - 1);
+  entry->prev = NULL;
+  entry->next = sched.slots[level][slot];
+  if (entry->next)
+    entry->next->prev = entry;
+  sched.slots[level][slot] = entry;
+  sched.occupied[level] |= 1ULL << slot;
+}
+
+static void sched_unlink(struct sched_entry *entry)
+{
+  for (int level = 0; level < SCHED_WHEEL_LEVELS; level++)
+    for (int slot = 0; entry->prev == NULL && slot < SCHED_SLOTS; slot++)
+      if (sched.slots[level][slot] == entry)
+      {
+        sched.slots[level][slot] = entry->next;
+        if (entry->next == NULL)
+          sched.occupied[level] &= ~(1ULL << slot);
+      }
+  if (entry->prev)
+    entry->prev->next = entry->next;
+  if (entry->next)
+    entry->next->prev = entry->prev;
+}
+
+/**
+ * Take the list out of a slot
+ */
+static struct sched_entry *sched_take(int level, int slot)
+{
+  struct sched_entry *list = sched.slots[level][slot];
+  sched.slots[level][slot] = NULL;
+  sched.occupied[level] &= ~(1ULL << slot);
+  return list;
+}
+
+/**
+ * @return next tick that expires entries or cascades a slot, -1 if empty
+ */
+static long sched_next_tick()
+{
+  long next = -1;
+  for (int level = 0; level < SCHED_WHEEL_LEVELS; level++)
+  {
+    if (sched.occupied[level] == 0)
+      continue;
+    int shift = SCHED_WHEEL_BITS * level;
+    int current = (sched.now >> shift) & (SCHED_SLOTS - 1);
+    // slots after the current one, wrapping around to it last
+    int from = (current + 1) & (SCHED_SLOTS - 1);
+    uint64_t rotated = sched.occupied[level] >> from;
+    if (from > 0)
+      rotated |= sched.occupied[level] << (SCHED_SLOTS - from);
+    long tick = ((sched.now >> shift) + __builtin_ctzll(rotated) + 1) << shift;
+    if (next == -1 || tick < next)
+      next = tick;
+  }
+  return next;
+}
+
+/**
+ * @return true if this shell runs the entries, taking the run lock if free
+ */
+static bool sched_runner()
+{
+  if (sched.run_fd != -1)
+    return true;
+  char path[4096 + 8];
+  snprintf(path, sizeof(path), "%s.run", sched.path);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return false;
+  if (flock(fd, LOCK_EX | LOCK_NB) == -1)
+  {
+    close(fd);
+    return false;
+  }
+  sched.run_fd = fd;
+  return true;
+}
+
+static void sched_run(struct sched_entry *entry)
+{
+  extern char **environ;
+  char *argv[] = {"sh", "-c", entry->command, NULL};
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  sigset_t defaults, empty;
+  job_signal_set(&defaults);
+  sigemptyset(&empty);
+  posix_spawnattr_setpgroup(&attr, 0); // out of the terminal's way
+  posix_spawnattr_setsigdefault(&attr, &defaults);
+  posix_spawnattr_setsigmask(&attr, &empty);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF |
+                                      POSIX_SPAWN_SETSIGMASK);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+  posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+  pid_t pid; // reaped by jobs_reap() like any child
+  posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  posix_spawnattr_destroy(&attr);
+}
+
+/**
+ * Process tick sched.now + 1: cascade the slots that come up, top level
+ * first, then run what expires
+ * @param real_now current time, runs missed while asleep are not repeated
+ */
+static void sched_advance(long real_now)
+{
+  long tick = ++sched.now;
+  int top = 0;
+  while (top < SCHED_WHEEL_LEVELS - 1 &&
+         (tick & ((1L << (SCHED_WHEEL_BITS * (top + 1))) - 1)) == 0)
+    top++;
+  for (int level = top; level > 0; level--)
+  {
+    int slot = (tick >> (SCHED_WHEEL_BITS * level)) & (SCHED_SLOTS - 1);
+    struct sched_entry *list = sched_take(level, slot);
+    while (list)
+    {
+      struct sched_entry *entry = list;
+      list = list->next;
+      sched_link(entry);
+    }
+  }
+  struct sched_entry *list = sched_take(0, tick & (SCHED_SLOTS - 1));
+  bool runner = list && sched_runner();
+  while (list)
+  {
+    struct sched_entry *entry = list;
+    list = list->next;
+    if (runner)
+      sched_run(entry);
+    entry->expires = (tick > real_now ? tick : real_now) + entry->interval;
+    sched_link(entry);
+  }
+}
+
+static void sched_tick(int timer, void *data);
+
+/**
+ * Catch up with the clock and arm the loop timer for the next tick with work
+ */
+static void sched_update()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  long next;
+  // ticks without work are skipped, entries are placed by absolute time
+  while ((next = sched_next_tick()) != -1 && next <= ts.tv_sec)
+  {
+    sched.now = next - 1;
+    sched_advance(ts.tv_sec);
+  }
+  if (sched.now < ts.tv_sec)
+    sched.now = ts.tv_sec;
+  if (sched.timer != -1)
+    loop_cancel_timer(sched.timer);
+  sched.timer = -1;
+  if (next != -1 && !shell_batch) // scripts edit the schedule, interactive shells run it
+    sched.timer = loop_add_timer((next - ts.tv_sec) * 1000 - ts.tv_nsec / 1000000, 0,
+                                 sched_tick, NULL);
+}
+
+static void sched_tick(int timer, void *data)
+{
+  sched.timer = -1; // one shot, already cancelled
+  sched_update();
+}
+
+static int sched_compare_ids(const void *a, const void *b)
+{
+  return (*(struct sched_entry **)a)->id - (*(struct sched_entry **)b)->id;
+}
+
+/**
+ * @return every entry sorted by id, to be freed
+ */
+static struct sched_entry **sched_entries()
+{
+  struct sched_entry **entries = malloc((sched.count + 1) * sizeof(struct sched_entry *));
+  int n = 0;
+  for (int level = 0; level < SCHED_WHEEL_LEVELS; level++)
+    for (int slot = 0; slot < SCHED_SLOTS; slot++)
+      for (struct sched_entry *entry = sched.slots[level][slot]; entry; entry = entry->next)
+        entries[n++] = entry;
+  qsort(entries, n, sizeof(struct sched_entry *), sched_compare_ids);
+  return entries;
+}
+
+/**
+ * Rewrite the schedule file, through a rename so a crash keeps the old one,
+ * under the lock of sched_lock()
+ * @return 0, -1 on error
+ */
+static int sched_save()
+{
+  char tmp[4096 + 8];
+  snprintf(tmp, sizeof(tmp), "%s.XXXXXX", sched.path);
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+    return -1;
+  FILE *file = fdopen(fd, "w");
+  if (file == NULL)
+  {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  struct sched_entry **entries = sched_entries();
+  for (int i = 0; i < sched.count; i++)
+    fprintf(file, "%d %ld %ld %s\n", entries[i]->id, entries[i]->interval,
+            entries[i]->expires, entries[i]->command);
+  free(entries);
+  if (fclose(file) != 0 || rename(tmp, sched.path) == -1)
+  {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
 
-  if (command->redirects[1] != NULL)
-  { // for >
-    int out = open(command->redirects[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (out == -1)
+static struct sched_entry *sched_add(int id, long interval, long expires, const char *command)
+{
+  struct sched_entry *entry = malloc(sizeof(struct sched_entry));
+  entry->id = id;
+  entry->interval = interval;
+  entry->expires = expires > sched.now ? expires : sched.now + 1;
+  entry->command = strdup(command);
+  sched_link(entry);
+  sched.count++;
+  if (id >= sched.next_id)
+    sched.next_id = id + 1;
+  return entry;
+}
+
+/**
+ * Take the lock every change of the schedule file is made under
+ * @param  operation LOCK_EX to change the file, LOCK_SH to read it
+ * @return           fd to close to unlock, -1 on error
+ */
+static int sched_lock(int operation)
+{
+  char path[4096 + 8];
+  snprintf(path, sizeof(path), "%s.lock", sched.path);
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return -1;
+  while (flock(fd, operation) == -1)
+    if (errno != EINTR)
     {
-      printf("Error opening redirect target file!\n");
+      close(fd);
+      return -1;
     }
-    dup2(out, STDOUT_FILENO); // copy file to stdout
-    close(out);
-  }
+  return fd;
+}
 
-  if (command->redirects[2] != NULL)
-  { // for >>
-    int out = open(command->redirects[2], O_WRONLY | O_CREAT | O_APPEND, 0644);
-    if (out == -1)
+/**
+ * Replace the wheel with the schedule file. Entries already known keep
+ * their next run, new ones continue their saved period.
+ */
+static void sched_load()
+{
+  struct sched_entry **old = sched_entries();
+  int old_count = sched.count;
+  memset(sched.slots, 0, sizeof(sched.slots));
+  memset(sched.occupied, 0, sizeof(sched.occupied));
+  sched.count = 0;
+  sched.next_id = 1;
+  sched.now = time(NULL); // the wheel is empty, it can jump
+
+  FILE *in = fopen(sched.path, "r");
+  char *line = NULL;
+  size_t cap = 0;
+  ssize_t len;
+  while (in && (len = getline(&line, &cap, in)) > 0)
+  {
+    int id, start = 0;
+    long interval, expires;
+    if (line[len - 1] == '\n')
+      line[len - 1] = '\0';
+    if (sscanf(line, "%d %ld %ld %n", &id, &interval, &expires, &start) != 3 ||
+        start == 0 || interval <= 0)
+      continue;
+    struct sched_entry *known = NULL;
+    for (int i = 0; i < old_count && known == NULL; i++)
+      if (old[i] && old[i]->id == id && old[i]->interval == interval &&
+          strcmp(old[i]->command, line + start) == 0)
+      {
+        known = old[i];
+        old[i] = NULL;
+      }
+    if (known)
     {
-      printf("Error opening redirect target file!\n");
+      expires = known->expires;
+      free(known->command);
+      free(known);
     }
-    dup2(out, STDOUT_FILENO); // copy file to stdout
-    close(out);
+    else if (expires <= sched.now) // missed runs while no shell was up
+      expires += ((sched.now - expires) / interval + 1) * interval;
+    sched_add(id, interval, expires, line + start);
   }
+  free(line);
+  if (in)
+    fclose(in);
+  for (int i = 0; i < old_count; i++)
+    if (old[i]) // removed by another shell
+    {
+      free(old[i]->command);
+      free(old[i]);
+    }
+  free(old);
+  sched_update();
 }
 
-int chatroom(struct command_t *command)
+/**
+ * Reload the schedule when another shell rewrote it
+ */
+static void sched_file_changed(int fd, uint32_t events, void *data)
 {
-  char chatroom_dir[100];
-  strcpy(chatroom_dir, "/tmp");
-  // create tmp folder if doesnt exist
-  if (mkdir(chatroom_dir, S_IRWXU | S_IRWXG | S_IRWXO) == -1)
-  {
-    if (errno != EEXIST)
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  const char *base = strrchr(sched.path, '/') ? strrchr(sched.path, '/') + 1 : sched.path;
+  bool changed = false;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0)
+    for (char *p = buf; p < buf + n;)
     {
-      printf("Chatroom error tmp folder: %s\n", strerror(errno));
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+      if ((ev->mask & IN_Q_OVERFLOW) || (ev->len > 0 && strcmp(ev->name, base) == 0))
+        changed = true;
     }
+  int lock = changed ? sched_lock(LOCK_SH) : -1;
+  if (lock != -1)
+  {
+    sched_load();
+    close(lock);
   }
-  strcat(chatroom_dir, "/chatroom-");
-  strcat(chatroom_dir, command->args[0]);
-  strcat(chatroom_dir, "/");
+}
 
-  // create room folder if doesnt exist
-  if (mkdir(chatroom_dir, S_IRWXU | S_IRWXG | S_IRWXO) == -1)
+/**
+ * Load the schedule file and follow the changes other shells make to it
+ */
+void sched_init()
+{
+  const char *file = getenv("SCHEDFILE");
+  if (file == NULL)
   {
-    if (errno != EEXIST)
-    {
-      printf("Chatroom error room folder: %s\n", strerror(errno));
-    }
+    const char *home = getenv("HOME");
+    snprintf(sched.path, sizeof(sched.path), "%s/.%s_sched", home ? home : "/tmp", sysname);
   }
+  else
+    snprintf(sched.path, sizeof(sched.path), "%s", file);
+  char dir[4096];
+  const char *slash = strrchr(sched.path, '/');
+  snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - sched.path) + 1 : 1,
+           slash ? sched.path : ".");
+  sched.watch_fd = shell_batch ? -1 : inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (sched.watch_fd != -1 &&
+      inotify_add_watch(sched.watch_fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR) != -1)
+    loop_add_fd(sched.watch_fd, EPOLLIN, sched_file_changed, NULL);
+  int lock = sched_lock(LOCK_SH);
+  sched_load();
+  if (lock != -1)
+    close(lock);
+}
 
-  char pipe_path[100];
-  // create user named pipe if doesnt exist
-  strcpy(pipe_path, chatroom_dir);
-  strcat(pipe_path, command->args[1]);
+/**
+ * @return seconds for 90, 90s, 5m, 2h or 1d, -1 if invalid
+ */
+static long sched_parse_interval(const char *text)
+{
+  char *end;
+  errno = 0;
+  long value = strtol(text, &end, 10);
+  long unit = 1;
+  if (*end == 'm')
+    unit = 60;
+  else if (*end == 'h')
+    unit = 3600;
+  else if (*end == 'd')
+    unit = 86400;
+  else if (*end != 's' && *end != '\0')
+    return -1;
+  if (errno || end == text || value <= 0 || (*end && end[1]) || value > LONG_MAX / unit)
+    return -1;
+  return value * unit;
+}
 
-  int fd;
-  char buff_in[140];
-  char buff_out[140];
+static void sched_format_interval(long seconds, char *buf, size_t size)
+{
+  if (seconds % 86400 == 0)
+    snprintf(buf, size, "%ldd", seconds / 86400);
+  else if (seconds % 3600 == 0)
+    snprintf(buf, size, "%ldh", seconds / 3600);
+  else if (seconds % 60 == 0)
+    snprintf(buf, size, "%ldm", seconds / 60);
+  else
+    snprintf(buf, size, "%lds", seconds);
+}
 
-  mkfifo(pipe_path, 0666);
-  if (errno != EEXIST)
+/**
+ * Schedule command every interval seconds and save the schedule
+ * @return id, -1 when it could not be saved
+ */
+static int sched_schedule(long interval, const char *command)
+{
+  int lock = sched_lock(LOCK_EX);
+  if (lock == -1)
   {
-    printf("Chatroom error named pipe: %s\n", strerror(errno));
+    printf("-%s: sched: %s.lock: %s\n", sysname, sched.path, strerror(errno));
+    return -1;
+  }
+  sched_load(); // ids and entries added by other shells meanwhile
+  struct sched_entry *entry =
+      sched_add(sched.next_id, interval, time(NULL) + interval, command);
+  sched_update();
+  int id = entry->id;
+  if (sched_save() == -1)
+  {
+    printf("-%s: sched: %s: %s\n", sysname, sched.path, strerror(errno));
+    id = -1;
   }
+  close(lock);
+  return id;
+}
 
-  printf("Welcome to %s!\n", command->args[0]);
-  pid_t pid = fork();
-  if (pid == 0)
+/**
+ * sched add interval command..., sched list, sched rm id
+ * @return SUCCESS or UNKNOWN on bad usage
+ */
+int sched_builtin(struct command_t *command)
+{
+  const char *action = command->arg_count > 0 ? command->args[0] : "";
+  if (strcmp(action, "list") == 0 && command->arg_count == 1)
+  {
+    struct sched_entry **entries = sched_entries();
+    long now = time(NULL);
+    for (int i = 0; i < sched.count; i++)
+    {
+      char every[32];
+      sched_format_interval(entries[i]->interval, every, sizeof(every));
+      printf("[%d] every %s, next in %lds: %s\n", entries[i]->id, every,
+             entries[i]->expires - now, entries[i]->command);
+    }
+    free(entries);
+    return SUCCESS;
+  }
+  if (strcmp(action, "rm") == 0 && command->arg_count == 2)
   {
-    while (1)
+    int id = atoi(command->args[1]);
+    int lock = sched_lock(LOCK_EX);
+    if (lock == -1)
+    {
+      printf("-%s: sched: %s.lock: %s\n", sysname, sched.path, strerror(errno));
+      return UNKNOWN;
+    }
+    sched_load();
+    struct sched_entry **entries = sched_entries();
+    struct sched_entry *found = NULL;
+    for (int i = 0; i < sched.count && found == NULL; i++)
+      if (entries[i]->id == id)
+        found = entries[i];
+    free(entries);
+    if (found == NULL)
     {
-      printf("[%s] %s >", command->args[0], command->args[1]);
+      close(lock);
+      printf("-%s: sched: %s: no such entry\n", sysname, command->args[1]);
+      return UNKNOWN;
+    }
+    sched_unlink(found);
+    sched.count--;
+    free(found->command);
+    free(found);
+    sched_update();
+    if (sched_save() == -1)
+      printf("-%s: sched: %s: %s\n", sysname, sched.path, strerror(errno));
+    close(lock);
+    return SUCCESS;
+  }
+  long interval = command->arg_count > 2 ? sched_parse_interval(command->args[1]) : -1;
+  if (strcmp(action, "add") != 0 || interval == -1)
+  {
+    printf("-%s: sched: usage: sched add interval[s|m|h|d] command... | list | rm id\n",
+           sysname);
+    return UNKNOWN;
+  }
+  char line[4096] = "";
+  size_t len = 0;
+  for (int i = 2; i < command->arg_count && len < sizeof(line); i++)
+    len += snprintf(line + len, sizeof(line) - len, "%s%s", i > 2 ? " " : "",
+                    command->args[i]);
+  int id = sched_schedule(interval, line);
+  if (id != -1)
+    printf("[%d] every %s: %s\n", id, command->args[1], line);
+  return SUCCESS;
+}
 
-      // get user message
-      fgets(buff_in, 140, stdin);
+/**
+ * wiseman minutes: a fortune read out loud every so often
+ */
+int wiseman(struct command_t *command)
+{
+  long minutes = command->arg_count == 1 ? atol(command->args[0]) : 0;
+  if (minutes <= 0)
+  {
+    printf("-%s: wiseman: usage: wiseman minutes\n", sysname);
+    return UNKNOWN;
+  }
+  if (sched_schedule(minutes * 60, "fortune | espeak") != -1)
+    printf("wiseman will speak for every %ld minutes.\n", minutes);
+  return SUCCESS;
+}
 
-      char temp_buff[180];
-      strcpy(temp_buff, "\n[");
-      strcat(temp_buff, command->args[0]);
-      strcat(temp_buff, "] ");
-      strcat(temp_buff, command->args[1]);
-      strcat(temp_buff, ": ");
-      strcat(temp_buff, buff_in);
+/*
+ * Fibonacci engine: fast doubling over bignums, O(log n) multiplications
+ * for F(n). Limbs are decimal so millions of digits print without a base
+ * conversion, products switch to Karatsuba above BIGNUM_KARATSUBA limbs.
+ */
+static const uint64_t fib_table[FIB_TABLE_SIZE] = {
+  0ULL, 1ULL, 1ULL, 2ULL, 3ULL, 5ULL, 8ULL, 13ULL, 21ULL, 34ULL, 55ULL, 89ULL, 144ULL,
+  233ULL, 377ULL, 610ULL, 987ULL, 1597ULL, 2584ULL, 4181ULL, 6765ULL, 10946ULL,
+  17711ULL, 28657ULL, 46368ULL, 75025ULL, 121393ULL, 196418ULL, 317811ULL, 514229ULL,
+  832040ULL, 1346269ULL, 2178309ULL, 3524578ULL, 5702887ULL, 9227465ULL, 14930352ULL,
+  24157817ULL, 39088169ULL, 63245986ULL, 102334155ULL, 165580141ULL, 267914296ULL,
+  433494437ULL, 701408733ULL, 1134903170ULL, 1836311903ULL, 2971215073ULL,
+  4807526976ULL, 7778742049ULL, 12586269025ULL, 20365011074ULL, 32951280099ULL,
+  53316291173ULL, 86267571272ULL, 139583862445ULL, 225851433717ULL, 365435296162ULL,
+  591286729879ULL, 956722026041ULL, 1548008755920ULL, 2504730781961ULL,
+  4052739537881ULL, 6557470319842ULL, 10610209857723ULL, 17167680177565ULL,
+  27777890035288ULL, 44945570212853ULL, 72723460248141ULL, 117669030460994ULL,
+  190392490709135ULL, 308061521170129ULL, 498454011879264ULL, 806515533049393ULL,
+  1304969544928657ULL, 2111485077978050ULL, 3416454622906707ULL, 5527939700884757ULL,
+  8944394323791464ULL, 14472334024676221ULL, 23416728348467685ULL, 37889062373143906ULL,
+  61305790721611591ULL, 99194853094755497ULL, 160500643816367088ULL,
+  259695496911122585ULL, 420196140727489673ULL, 679891637638612258ULL,
+  1100087778366101931ULL, 1779979416004714189ULL, 2880067194370816120ULL,
+  4660046610375530309ULL, 7540113804746346429ULL, 12200160415121876738ULL
+};
 
-      DIR *d;
-      struct dirent *dir;
-      d = opendir(chatroom_dir);
-      char *write_pipe = (char *)malloc(1 * sizeof(char));
-      write_pipe[0] = '\0';
-      char *temp = (char *)malloc((strlen(write_pipe) + 1) * sizeof(char));
-      if (d)
-      {
-        while ((dir = readdir(d)) != NULL)
-        {
+struct bignum
+{
+  uint32_t *limb; // least significant first, base BIGNUM_BASE
+  size_t len;
+};
 
-          if ((strcmp(dir->d_name, command->args[1]) != 0) && dir->d_name[0] != '.')
-          {
-            // each time keep the room directory, append the username
-            temp = (char *)realloc(temp, (strlen(chatroom_dir) + strlen(dir->d_name) + 1) * sizeof(char));
-            strcat(temp, chatroom_dir);
-            strcat(temp, dir->d_name);
-            //printf("%s \n", temp);
-
-            fd = open(temp, O_WRONLY);
-            // write to other pipes
-            write(fd, temp_buff, strlen(temp_buff) + 1);
-
-            close(fd);
-            temp[0] = '\0';
-          }
-        }
-        closedir(d);
-      }
-    }
+/**
+ * r[0..n) += a[0..an), limbs of a past n must be zero
+ * @return carry out of r[n-1]
+ */
+static uint32_t bignum_add_to(uint32_t *r, size_t n, const uint32_t *a, size_t an)
+{
+  uint32_t carry = 0;
+  for (size_t i = 0; i < n && (i < an || carry); i++)
+  {
+    uint32_t sum = r[i] + (i < an ? a[i] : 0) + carry;
+    carry = sum >= BIGNUM_BASE;
+    r[i] = carry ? sum - BIGNUM_BASE : sum;
   }
-  else
+  return carry;
+}
+
+/**
+ * r[0..n) -= a[0..an), the difference must not be negative
+ */
+static void bignum_sub_from(uint32_t *r, size_t n, const uint32_t *a, size_t an)
+{
+  uint32_t borrow = 0;
+  for (size_t i = 0; i < n && (i < an || borrow); i++)
+  {
+    uint32_t sub = (i < an ? a[i] : 0) + borrow;
+    borrow = r[i] < sub;
+    r[i] = borrow ? r[i] + BIGNUM_BASE - sub : r[i] - sub;
+  }
+}
+
+static void bignum_mul_school(uint32_t *r, const uint32_t *a, size_t an, const uint32_t *b,
+                              size_t bn)
+{
+  memset(r, 0, (an + bn) * sizeof(*r));
+  for (size_t i = 0; i < an; i++)
   {
-    while (1)
+    if (a[i] == 0)
+      continue;
+    uint64_t carry = 0; // stays below BIGNUM_BASE
+    for (size_t j = 0; j < bn; j++)
     {
-      // read from YOUR pipe only
-      fd = open(pipe_path, O_RDONLY);
-      read(fd, buff_out, sizeof(buff_out));
-      printf("%s", buff_out);
-      close(fd);
+      uint64_t cur = r[i + j] + (uint64_t)a[i] * b[j] + carry;
+      r[i + j] = cur % BIGNUM_BASE;
+      carry = cur / BIGNUM_BASE;
     }
+    r[i + bn] = carry;
   }
 }
 
-int motivation_prompt(int cycle_no, int max_cycle)
+/**
+ * r[0..an+bn) = a * b, Karatsuba above BIGNUM_KARATSUBA limbs
+ * @return 0, -1 when a temporary could not be allocated
+ */
+static int bignum_mul(uint32_t *r, const uint32_t *a, size_t an, const uint32_t *b, size_t bn)
 {
-  if (cycle_no == 1)
+  if (an < bn)
   {
-    printf("Good luck working, keep it zen ⊹╰(⌣ʟ⌣)╯⊹\n");
+    const uint32_t *t = a;
+    a = b;
+    b = t;
+    size_t tn = an;
+    an = bn;
+    bn = tn;
   }
-  if (cycle_no == max_cycle)
+  if (bn < BIGNUM_KARATSUBA)
   {
-    printf("Last cycle! You got this ᕙ(⌣◡⌣”)ᕗ\n");
+    bignum_mul_school(r, a, an, b, bn);
+    return 0;
+  }
+  size_t m = an / 2; // a = a0 + a1 B^m
+  if (bn <= m)
+  {
+    // too short to split: r = a0 b + a1 b B^m
+    uint32_t *high = malloc((an - m + bn) * sizeof(*high));
+    if (high == NULL || bignum_mul(r, a, m, b, bn) == -1)
+    {
+      free(high);
+      return -1;
+    }
+    memset(r + m + bn, 0, (an - m) * sizeof(*r));
+    if (bignum_mul(high, a + m, an - m, b, bn) == -1)
+    {
+      free(high);
+      return -1;
+    }
+    bignum_add_to(r + m, an + bn - m, high, an - m + bn);
+    free(high);
+    return 0;
   }
+  // z0 = a0 b0, z2 = a1 b1, z1 = (a0 + a1)(b0 + b1) - z0 - z2
+  // r = z0 + z1 B^m + z2 B^2m
+  size_t a1n = an - m, b1n = bn - m;
+  size_t sn = a1n + 1, tn = (b1n > m ? b1n : m) + 1;
+  uint32_t *sa = calloc(2 * (sn + tn), sizeof(*sa)), *sb = sa + sn, *z1 = sb + tn;
+  if (sa == NULL)
+    return -1;
+  memcpy(sa, a + m, a1n * sizeof(*sa));
+  bignum_add_to(sa, sn, a, m);
+  memcpy(sb, b + m, b1n * sizeof(*sb));
+  bignum_add_to(sb, tn, b, m);
+  while (sn > 1 && sa[sn - 1] == 0)
+    sn--;
+  while (tn > 1 && sb[tn - 1] == 0)
+    tn--;
+  if (bignum_mul(r, a, m, b, m) == -1 || bignum_mul(r + 2 * m, a + m, a1n, b + m, b1n) == -1 ||
+      bignum_mul(z1, sa, sn, sb, tn) == -1)
+  {
+    free(sa);
+    return -1;
+  }
+  bignum_sub_from(z1, sn + tn, r, 2 * m);
+  bignum_sub_from(z1, sn + tn, r + 2 * m, a1n + b1n);
+  bignum_add_to(r + m, an + bn - m, z1, sn + tn);
+  free(sa);
+  return 0;
 }
 
-int pomodoro(struct command_t *command)
+static void bignum_trim(struct bignum *x)
 {
-  int num_cycles = atoi(command->args[0]);
-  for (int i = 1; i <= num_cycles; i++)
+  while (x->len > 1 && x->limb[x->len - 1] == 0)
+    x->len--;
+}
+
+/*
+ * The constructors below return a bignum with a NULL limb array when out
+ * of memory, bignum_free() accepts it.
+ */
+static struct bignum bignum_from_u64(uint64_t value)
+{
+  struct bignum x = {malloc(3 * sizeof(uint32_t)), 0};
+  if (x.limb == NULL)
+    return x;
+  do
   {
-    printf("\aEntering pomodoro cycle %d ... ", i);
+    x.limb[x.len++] = value % BIGNUM_BASE;
+    value /= BIGNUM_BASE;
+  } while (value > 0);
+  return x;
+}
 
-    motivation_prompt(i, num_cycles);
+static struct bignum bignum_product(const struct bignum *a, const struct bignum *b)
+{
+  struct bignum r = {malloc((a->len + b->len) * sizeof(uint32_t)), a->len + b->len};
+  if (r.limb == NULL || bignum_mul(r.limb, a->limb, a->len, b->limb, b->len) == -1)
+  {
+    free(r.limb);
+    return (struct bignum){NULL, 0};
+  }
+  bignum_trim(&r);
+  return r;
+}
 
-    pid_t pid = fork();
-    if (pid == 0)
-    {
-      int study_min = atoi(command->args[1]);
-      // printf("study ID: %d\n",getpid());
-      if ((study_min - 5) > 0)
-      {
-        sleep((study_min - 5) * 60);
-        printf("Last five minutes... little goes a long way!\n");
-        sleep(5 * 60);
-      }
-      else
-      {
-        sleep(study_min * 60);
-      }
+/**
+ * a + b when sign > 0, 2a - b when sign < 0 (never negative here)
+ */
+static struct bignum bignum_combine(const struct bignum *a, const struct bignum *b, int sign)
+{
+  size_t len = (a->len > b->len ? a->len : b->len) + 1;
+  struct bignum r = {calloc(len, sizeof(uint32_t)), len};
+  if (r.limb == NULL)
+    return (struct bignum){NULL, 0};
+  memcpy(r.limb, a->limb, a->len * sizeof(uint32_t));
+  if (sign > 0)
+    bignum_add_to(r.limb, len, b->limb, b->len);
+  else
+  {
+    bignum_add_to(r.limb, len, a->limb, a->len);
+    bignum_sub_from(r.limb, len, b->limb, b->len);
+  }
+  bignum_trim(&r);
+  return r;
+}
+
+static void bignum_free(struct bignum *x)
+{
+  free(x->limb);
+  x->limb = NULL;
+  x->len = 0;
+}
+
+/**
+ * Decimal digits of x, written in batches
+ */
+static int bignum_write(struct out_buf *out, const struct bignum *x)
+{
+  char digits[16];
+  int len = snprintf(digits, sizeof(digits), "%u", x->limb[x->len - 1]);
+  if (out_write(out, digits, len) == -1)
+    return -1;
+  for (size_t i = x->len - 1; i-- > 0;)
+  {
+    uint32_t limb = x->limb[i];
+    for (int d = 8; d >= 0; d--, limb /= 10)
+      digits[d] = '0' + limb % 10;
+    if (out_write(out, digits, 9) == -1)
+      return -1;
+  }
+  return 0;
+}
 
-      exit(0);
+/**
+ * F(n) by fast doubling, seeded from the table with the top bits of n:
+ * F(2k) = F(k) (2 F(k+1) - F(k)), F(2k+1) = F(k)^2 + F(k+1)^2
+ * @return F(n), with a NULL limb array when out of memory
+ */
+static struct bignum fib_big(unsigned long n)
+{
+  if (n < FIB_TABLE_SIZE)
+    return bignum_from_u64(fib_table[n]);
+  int shift = 0;
+  while ((n >> shift) + 1 >= FIB_TABLE_SIZE)
+    shift++;
+  unsigned long k = n >> shift;
+  struct bignum a = bignum_from_u64(fib_table[k]), b = bignum_from_u64(fib_table[k + 1]);
+  while (shift-- > 0)
+  {
+    if (a.limb == NULL || b.limb == NULL)
+      break;
+    bool bit = (n >> shift) & 1;
+    struct bignum even = {NULL, 0}, odd = {NULL, 0};
+    if (shift > 0 || !bit) // the last step only needs one of them
+    {
+      struct bignum t = bignum_combine(&b, &a, -1);
+      if (t.limb != NULL)
+        even = bignum_product(&a, &t);
+      bignum_free(&t);
+    }
+    if (shift > 0 || bit)
+    {
+      struct bignum aa = bignum_product(&a, &a), bb = bignum_product(&b, &b);
+      if (aa.limb != NULL && bb.limb != NULL)
+        odd = bignum_combine(&aa, &bb, 1);
+      bignum_free(&aa);
+      bignum_free(&bb);
+    }
+    bignum_free(&a);
+    bignum_free(&b);
+    if ((shift > 0 || !bit) && even.limb == NULL)
+    {
+      bignum_free(&odd);
+      return even;
+    }
+    if ((shift > 0 || bit) && odd.limb == NULL)
+    {
+      bignum_free(&even);
+      return odd;
+    }
+    if (shift == 0)
+      return bit ? odd : even;
+    if (bit)
+    {
+      a = odd;
+      b = bignum_combine(&even, &odd, 1);
+      bignum_free(&even);
     }
     else
     {
-      wait(0);
-      if (i == num_cycles)
-      {
-        printf("Great Job! You completed ALL your cycles ( ⌒o⌒)人(⌒-⌒\n");
-      }
-      else
-      {
-        printf("Nice... You completed %d cycle(s) \n", i);
-        // printf("break ID: %d\n",getpid());
-        printf("\aNow its time for a %s minute break...\n", command->args[2]);
-        int break_mins = atoi(command->args[2]);
-        sleep(break_mins * 60);
-      }
+      a = even;
+      b = odd;
     }
   }
+  bignum_free(&a); // out of memory, n has bits below the table
+  bignum_free(&b);
+  return a;
 }
 
-int fib(int n)
+/**
+ * The original exponential recursion, kept as the benchmark baseline
+ */
+static uint64_t fib_recursive(int n)
 {
   if (n <= 1)
     return n;
-  return fib(n - 1) + fib(n - 2); // recursive function call
+  return fib_recursive(n - 1) + fib_recursive(n - 2);
+}
+
+static double fib_elapsed_ms(const struct timespec *begin)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - begin->tv_sec) * 1e3 + (end.tv_nsec - begin->tv_nsec) / 1e6;
+}
+
+int fib(int n)
+{
+  return fib_table[n]; // fits an int up to F(46)
+}
+
+/**
+ * fib plays the guessing game, fib -n N prints F(N) exactly, fib -b N
+ * times the engine against the recursion, which only runs up to
+ * FIB_RECURSION_MAX
+ * @return SUCCESS or UNKNOWN on bad usage
+ */
+int fib_builtin(struct command_t *command)
+{
+  if (command->arg_count == 0)
+  {
+    int arr[GAME_ARRAY_SIZE] = {0}; // initialization
+    arr[1] = 1;
+    fibonacci_game(arr);
+    getchar();
+    return SUCCESS;
+  }
+  char *end = NULL;
+  unsigned long n = 0;
+  if (command->arg_count == 2)
+  {
+    errno = 0;
+    n = strtoul(command->args[1], &end, 10);
+  }
+  if (command->arg_count != 2 || *command->args[1] == '-' || *end != '\0' || errno ||
+      (strcmp(command->args[0], "-n") && strcmp(command->args[0], "-b")))
+  {
+    printf("-%s: fib: usage: fib [-n N | -b N]\n", sysname);
+    return UNKNOWN;
+  }
+  if (n > FIB_N_MAX)
+  {
+    printf("-%s: fib: %lu: larger than %lu\n", sysname, n, FIB_N_MAX);
+    return UNKNOWN;
+  }
+
+  struct timespec begin;
+  clock_gettime(CLOCK_MONOTONIC, &begin);
+  struct bignum value = fib_big(n);
+  double engine_ms = fib_elapsed_ms(&begin);
+  if (value.limb == NULL)
+  {
+    printf("-%s: fib: %lu: %s\n", sysname, n, strerror(ENOMEM));
+    return UNKNOWN;
+  }
+  if (strcmp(command->args[0], "-n") == 0)
+  {
+    struct out_buf *out = malloc(sizeof(struct out_buf));
+    if (out == NULL)
+    {
+      printf("-%s: fib: %s\n", sysname, strerror(ENOMEM));
+      bignum_free(&value);
+      return UNKNOWN;
+    }
+    out->fd = STDOUT_FILENO;
+    out->len = 0;
+    fflush(stdout);
+    if (bignum_write(out, &value) == -1 || out_write(out, "\n", 1) == -1 ||
+        out_flush(out) == -1)
+      printf("-%s: fib: %s\n", sysname, strerror(errno));
+    free(out);
+    bignum_free(&value);
+    return SUCCESS;
+  }
+
+  size_t digits = (value.len - 1) * 9 + snprintf(NULL, 0, "%u", value.limb[value.len - 1]);
+  printf("fib(%lu): %zu digits, fast doubling %.3f ms\n", n, digits, engine_ms);
+  if (n <= FIB_RECURSION_MAX)
+  {
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    uint64_t expected = fib_recursive(n);
+    double recursive_ms = fib_elapsed_ms(&begin);
+    printf("fib(%lu): recursion %.3f ms, %s\n", n, recursive_ms,
+           expected == fib_table[n] ? "same value" : "DIFFERENT value");
+  }
+  else
+    printf("fib(%lu): recursion skipped above fib(%d)\n", n, FIB_RECURSION_MAX);
+  bignum_free(&value);
+  return SUCCESS;
 }
 
 void fibonacci_game(int arr[])